@@ -1,12 +1,44 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own lock, so lookups on different CPUs rarely contend.
+// bcache.lock serializes misses, growing and shrinking, so that only
+// one CPU ever holds two bucket locks.
+//
+// Buffers live in kalloc'd pages. The cache starts with NBUF buffers
+// and a miss adds a page while free memory lasts, up to
+// 1/BCACHE_DIV of RAM. When kalloc runs out it calls bshrink, which
+// gives back pages whose buffers are all unused.
+//
+// Once the cache can't grow, a miss recycles an unused buffer, with
+// the 2Q policy so that one pass over a big file can't push out the
+// inode, bitmap and directory blocks in use. A block read for the
+// first time goes to the probation queue, FIFO. Blocks evicted from
+// it are remembered in a ghost list, and a block missed again while
+// it is still there goes to the hot queue, where buffers used since
+// they were last passed over get a second chance. Probation is
+// recycled first once it holds more than 1/BPROBATION_DIV of the
+// buffers. bcachestat() counts hits, misses, evictions and ghost
+// hits.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To start reading a block that will be needed soon, call
+//     bread_async; a later bread waits for it.
+// * To read up to NSEG adjacent blocks with one disk request, call
+//     bread_range.
+// * To write several runs of private bufs at once, call
+//     bwrite_private for each run and then bwait for each buf.
+// * To overwrite a whole block without reading it first, get its
+//     buffer with bgrab instead of bread.
+// * To have the buffer written later, call bdwrite instead of
+//     bwrite. bflush writes such dirty buffers in batches sorted
+//     by block, as does a miss that finds nothing else to recycle.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
@@ -19,73 +51,531 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
-struct {
+#define NBUCKET 13
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head; // list of the bucket's buffers, through prev/next
+  uint64 hits;     // bgets that found a buffer here
+};
+
+// A page of buffers.
+struct bufpage {
+  struct bufpage *next;
+  struct buf buf[];
+};
+
+#define BUFS_PER_PAGE ((PGSIZE - sizeof(struct bufpage)) / sizeof(struct buf))
+#define BCACHE_RESERVE 64 // free pages the cache leaves to everyone else
+#define BSYNC_BATCH 32    // buffers written at once by bsync
+#define BPROBATION_DIV 4  // probation goes first once over 1/BPROBATION_DIV of buffers
+#define NGHOST 512        // blocks evicted from probation that are remembered
+#define NGHOSTHASH 64
+
+// A block evicted from probation.
+struct ghost {
+  uint dev;
+  uint blockno;
+  int used;
+  int next; // hash chain, -1 at the end
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock; // held while recycling, adding or freeing buffers
+  struct bufpage *pages;
+  int nbuf;
+  int max;              // most buffers the cache may grow to
+  int ndirty;           // buffers with dirty set
+
+  // 2Q replacement, protected by lock. Queues go oldest first.
+  struct buf probation;
+  struct buf hot;
+  int nprobation;
+  int nhot;
+  struct ghost ghost[NGHOST]; // a ring
+  int ghosthash[NGHOSTHASH];
+  int ghostnext;              // slot the next ghost goes to
+  uint64 misses;
+  uint64 evictions;
+  uint64 ghosthits;
+
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bucket(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+static void
+bucket_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+bucket_insert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+static int
+disk_rw(struct buf *b, int write)
+{
+  virtio_disk_rw(VIRTIO0_ID, b, write);
+  return 0;
+}
+
+static int
+disk_flush(void)
+{
+  virtio_disk_flush(VIRTIO0_ID);
+  return 0;
+}
+
+static int
+disk_submit(struct buf **bs, int n, int write)
+{
+  virtio_disk_submit_range(VIRTIO0_ID, bs, n, write);
+  return 0;
+}
+
+static void
+disk_wait(struct buf *b)
+{
+  virtio_disk_wait(VIRTIO0_ID, b);
+}
+
+static struct bdevsw bdevsw[NBDEV] = {
+  [DISKDEV] { disk_rw, disk_flush, disk_submit, disk_wait },
+  [RAIDDEV] { raid_bdev_rw, raid_bdev_flush, 0, 0 },
+};
+
+// Move b to or from the device it belongs to.
+static void
+bdev_rw(struct buf *b, int write)
+{
+  if(b->dev >= NBDEV || bdevsw[b->dev].rw == 0)
+    panic("bdev_rw: no device");
+  if(bdevsw[b->dev].rw(b, write) < 0)
+    panic("bdev_rw: I/O error");
+}
+
+// Put b after a in a replacement queue.
+static void
+qinsert(struct buf *a, struct buf *b)
+{
+  b->qnext = a->qnext;
+  b->qprev = a;
+  a->qnext->qprev = b;
+  a->qnext = b;
+}
+
+static void
+qremove(struct buf *b)
+{
+  b->qnext->qprev = b->qprev;
+  b->qprev->qnext = b->qnext;
+  if(b->hot)
+    bcache.nhot--;
+  else
+    bcache.nprobation--;
+}
+
+// Append b, newest, to the hot queue or to probation.
+static void
+qappend(struct buf *b, int hot)
+{
+  b->hot = hot;
+  if(hot){
+    qinsert(bcache.hot.qprev, b);
+    bcache.nhot++;
+  } else {
+    qinsert(bcache.probation.qprev, b);
+    bcache.nprobation++;
+  }
+}
+
+static int
+ghosthash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NGHOSTHASH;
+}
+
+static void
+ghost_unlink(int i)
+{
+  int *pp;
+
+  for(pp = &bcache.ghosthash[ghosthash(bcache.ghost[i].dev, bcache.ghost[i].blockno)];
+      *pp != i; pp = &bcache.ghost[*pp].next)
+    ;
+  *pp = bcache.ghost[i].next;
+  bcache.ghost[i].used = 0;
+}
+
+// Remember a block evicted from probation, forgetting the oldest.
+static void
+ghost_add(uint dev, uint blockno)
+{
+  int i = bcache.ghostnext;
+  int *head = &bcache.ghosthash[ghosthash(dev, blockno)];
+
+  bcache.ghostnext = (i + 1) % NGHOST;
+  if(bcache.ghost[i].used)
+    ghost_unlink(i);
+  bcache.ghost[i].dev = dev;
+  bcache.ghost[i].blockno = blockno;
+  bcache.ghost[i].used = 1;
+  bcache.ghost[i].next = *head;
+  *head = i;
+}
+
+// Was the block evicted from probation recently? Forgets it.
+static int
+ghost_take(uint dev, uint blockno)
+{
+  int i;
+
+  for(i = bcache.ghosthash[ghosthash(dev, blockno)]; i >= 0; i = bcache.ghost[i].next){
+    if(bcache.ghost[i].dev == dev && bcache.ghost[i].blockno == blockno){
+      ghost_unlink(i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Start moving the n locked bufs in bs, which hold adjacent blocks
+// of one device, with one request. On a device without submit they
+// are moved one at a time before this returns. bwait for each.
+static void
+bsubmit(struct buf **bs, int n, int write)
+{
+  uint dev = bs[0]->dev;
+
+  if(bdevsw[dev].submit && bdevsw[dev].submit(bs, n, write) == 0)
+    return;
+  for(int i = 0; i < n; i++)
+    bdev_rw(bs[i], write);
+}
+
+// Add a page of unused buffers. Caller must hold bcache.lock.
+static void
+bgrow(struct bufpage *pg)
+{
+  struct buf *b;
+  struct bucket *bk = bucket(0, 0);
+
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  for(b = pg->buf; b < pg->buf+BUFS_PER_PAGE; b++){
+    memset(b, 0, sizeof(*b));
+    initsleeplock(&b->lock, "buffer");
+    acquire(&bk->lock);
+    bucket_insert(bk, b);
+    release(&bk->lock);
+    // First in line for recycling.
+    qinsert(&bcache.probation, b);
+    bcache.nprobation++;
+  }
+  bcache.nbuf += BUFS_PER_PAGE;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+
+  if(BUFS_PER_PAGE < 1)
+    panic("binit: buf too big");
 
   initlock(&bcache.lock, "bcache");
+  bcache.probation.qprev = bcache.probation.qnext = &bcache.probation;
+  bcache.hot.qprev = bcache.hot.qnext = &bcache.hot;
+  for(int i = 0; i < NGHOSTHASH; i++)
+    bcache.ghosthash[i] = -1;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.max = (PHYSTOP - KERNBASE) / BCACHE_DIV / PGSIZE * BUFS_PER_PAGE;
+  if(bcache.max < NBUF)
+    bcache.max = NBUF;
+
+  while(bcache.nbuf < NBUF){
+    struct bufpage *pg = kalloc();
+    if(pg == 0)
+      panic("binit: no memory");
+    acquire(&bcache.lock);
+    bgrow(pg);
+    release(&bcache.lock);
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf*
-bget(uint dev, uint blockno)
+// Give back up to npages pages whose buffers are all unused,
+// keeping at least NBUF buffers. Called by kalloc when it runs out,
+// so it must not be called with bcache.lock or a bucket lock held.
+// Returns the number of pages freed.
+int
+bshrink(int npages)
 {
+  struct bufpage **pp, *pg;
   struct buf *b;
+  int freed = 0;
 
   acquire(&bcache.lock);
+  pp = &bcache.pages;
+  while((pg = *pp) != 0 && freed < npages && bcache.nbuf - BUFS_PER_PAGE >= NBUF){
+    // Only this CPU can hold more than one bucket lock, see bget.
+    struct bucket *held[BUFS_PER_PAGE];
+    int nheld = 0, busy = 0;
+    for(b = pg->buf; b < pg->buf+BUFS_PER_PAGE; b++){
+      struct bucket *bk = bucket(b->dev, b->blockno);
+      int k;
+      for(k = 0; k < nheld && held[k] != bk; k++)
+        ;
+      if(k == nheld){
+        acquire(&bk->lock);
+        held[nheld++] = bk;
+      }
+      busy |= b->refcnt != 0 || b->dirty;
+    }
+    if(!busy){
+      for(b = pg->buf; b < pg->buf+BUFS_PER_PAGE; b++){
+        bucket_remove(b);
+        qremove(b);
+      }
+    }
+    while(nheld > 0)
+      release(&held[--nheld]->lock);
+    if(busy){
+      pp = &pg->next;
+      continue;
+    }
+
+    *pp = pg->next;
+    bcache.nbuf -= BUFS_PER_PAGE;
+    kfree(pg);
+    freed++;
+  }
+  release(&bcache.lock);
+  return freed;
+}
+
+// Find block blockno of dev in its bucket and take a reference.
+// Caller must hold the bucket's lock.
+static struct buf*
+lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head.next; b != &bk->head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Find block blockno of dev and take a reference to it.
+// With nowait, leave a cached block alone and return 0.
+static struct buf*
+cached(struct bucket *bk, uint dev, uint blockno, int nowait)
+{
+  struct buf *b;
+
+  acquire(&bk->lock);
+  b = lookup(bk, dev, blockno);
+  if(b && nowait)
+    b->refcnt--;
+  else if(b)
+    bk->hits++;
+  release(&bk->lock);
+  return b;
+}
+
+// Oldest unused, clean buffer of probation, or 0. If found, it
+// is returned with its bucket locked in *held and, if it holds a
+// block, the block becomes a ghost. Caller must hold bcache.lock.
+static struct buf*
+evict_probation(struct bucket **held)
+{
+  struct buf *b;
+
+  for(b = bcache.probation.qnext; b != &bcache.probation; b = b->qnext){
+    *held = bucket(b->dev, b->blockno);
+    acquire(&(*held)->lock);
+    if(b->refcnt == 0 && !b->dirty){
+      if(b->valid)
+        ghost_add(b->dev, b->blockno);
+      return b;
+    }
+    release(&(*held)->lock);
+  }
+  return 0;
+}
+
+// Oldest unused, clean buffer of the hot queue that hasn't been
+// used since it was last passed over, or 0. Passed over buffers go
+// to the back. Caller must hold bcache.lock.
+static struct buf*
+evict_hot(struct bucket **held)
+{
+  struct buf *b;
+
+  for(int n = 2*bcache.nhot; n > 0 && bcache.hot.qnext != &bcache.hot; n--){
+    b = bcache.hot.qnext;
+    *held = bucket(b->dev, b->blockno);
+    acquire(&(*held)->lock);
+    if(b->refcnt == 0 && !b->referenced && !b->dirty)
+      return b;
+    b->referenced = 0;
+    release(&(*held)->lock);
+    qremove(b);
+    qappend(b, 1);
+  }
+  return 0;
+}
+
+// Pick a buffer to recycle and return it with its bucket locked in
+// *held, or 0 if none is unused and clean. Unused buffers go first,
+// then probation if it is big, then the hot queue.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(struct bucket **held)
+{
+  struct buf *b;
+  int first;
+
+  b = bcache.probation.qnext;
+  if(b != &bcache.probation && !b->valid){
+    *held = bucket(b->dev, b->blockno);
+    acquire(&(*held)->lock);
+    if(b->refcnt == 0 && !b->valid)
+      return b;
+    release(&(*held)->lock);
+  }
+
+  first = bcache.nprobation > bcache.nbuf / BPROBATION_DIV || bcache.nhot == 0;
+  if(first && (b = evict_probation(held)) != 0)
+    return b;
+  if((b = evict_hot(held)) != 0)
+    return b;
+  if(!first)
+    return evict_probation(held);
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// With nowait, return 0 if the block is cached, since waiting
+// for its lock could block.
+static struct buf*
+bget(uint dev, uint blockno, int nowait)
+{
+  struct buf *b, *victim;
+  struct bucket *bk = bucket(dev, blockno);
+  struct bucket *held;
+
+again:
+  if((b = cached(bk, dev, blockno, nowait)) != 0){
+    if(nowait)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  acquire(&bcache.lock);
+
+  // Another CPU may have read it in meanwhile.
+  if((b = cached(bk, dev, blockno, nowait)) != 0){
+    release(&bcache.lock);
+    if(nowait)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Grow while memory is plentiful. kalloc may call bshrink,
+  // so bcache.lock can't be held across it.
+  if(bcache.nbuf < bcache.max && kfreepages() > BCACHE_RESERVE){
+    release(&bcache.lock);
+    struct bufpage *pg = kalloc();
+    acquire(&bcache.lock);
+    if(pg && bcache.nbuf < bcache.max)
+      bgrow(pg);
+    else if(pg)
+      kfree(pg);
+
+    // Someone may have read it in while the lock was dropped.
+    if((b = cached(bk, dev, blockno, nowait)) != 0){
       release(&bcache.lock);
+      if(nowait)
+        return 0;
       acquiresleep(&b->lock);
       return b;
     }
   }
-  panic("bget: no buffers");
+
+  victim = bvictim(&held);
+  if(victim == 0 && bcache.ndirty > 0){
+    // Everything unused is dirty; write it out and try again.
+    // bsync won't wait for buffers the caller may hold.
+    release(&bcache.lock);
+    if(bsync(-1, 0) == 0)
+      panic("bget: no buffers");
+    goto again;
+  }
+  if(victim == 0)
+    panic("bget: no buffers");
+
+  if(victim->valid)
+    bcache.evictions++;
+  if(!nowait)
+    bcache.misses++;
+  qremove(victim);
+  if(ghost_take(dev, blockno)){
+    bcache.ghosthits++;
+    qappend(victim, 1);
+  } else {
+    qappend(victim, 0);
+  }
+  victim->referenced = 0;
+
+  bucket_remove(victim);
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  release(&held->lock);
+
+  // Nobody else can find it yet, so this doesn't sleep, and the
+  // caller is the first to see the block.
+  acquiresleep(&victim->lock);
+
+  acquire(&bk->lock);
+  bucket_insert(bk, victim);
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +584,311 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(VIRTIO0_ID, b, 0);
+    bdev_rw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Completion of bread_async, called from the disk interrupt.
+// Like brelse, but the lock was taken by the process that
+// started the read.
+static void
+bread_done(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->done = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  bk = bucket(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  b->referenced = 1;
+  release(&bk->lock);
+}
+
+// Start reading the run in bs with one request, bread_done
+// finishing each buffer.
+static void
+bread_run(uint dev, struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    bs[i]->done = bread_done;
+  if(bdevsw[dev].submit(bs, n, 0) == 0)
+    return;
+  for(i = 0; i < n; i++){
+    bs[i]->done = 0;
+    brelse(bs[i]);
+  }
+}
+
+// Start reading n blocks from blockno into the cache and return
+// without waiting, with one request per run of blocks that aren't
+// cached yet. A buffer stays locked until its read is done, so a
+// bread of the block waits for it. Does nothing if the device can
+// only do synchronous I/O.
+void
+bread_async(uint dev, uint blockno, int n)
+{
+  struct buf *bs[NSEG], *b;
+  int nb = 0;
+
+  if(dev >= NBDEV || bdevsw[dev].submit == 0)
+    return;
+  for(int i = 0; i < n; i++){
+    if((b = bget(dev, blockno + i, 1)) != 0)
+      bs[nb++] = b;
+    if(nb > 0 && (b == 0 || nb == NSEG)){
+      bread_run(dev, bs, nb);
+      nb = 0;
+    }
+  }
+  if(nb > 0)
+    bread_run(dev, bs, nb);
+}
+
+// Return n locked bufs with the contents of blocks blockno to
+// blockno+n-1 in bs, reading each run of them that isn't cached
+// with one request. n must not be more than NSEG.
+void
+bread_range(uint dev, uint blockno, int n, struct buf **bs)
+{
+  int i, j;
+
+  if(n > NSEG)
+    panic("bread_range");
+  for(i = 0; i < n; i++)
+    bs[i] = bget(dev, blockno + i, 0);
+
+  for(i = 0; i < n; i = j){
+    if(bs[i]->valid){
+      j = i + 1;
+      continue;
+    }
+    for(j = i + 1; j < n && !bs[j]->valid; j++)
+      ;
+    bsubmit(&bs[i], j - i, 0);
+    for(int k = i; k < j; k++){
+      bwait(bs[k]);
+      bs[k]->valid = 1;
+    }
+  }
+}
+
+// Return a locked buf for the indicated block without reading it.
+// The caller overwrites all of its data before releasing it.
+struct buf*
+bgrab(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
+// Start writing n bufs the caller owns outside the cache, such as
+// private copies of cached blocks, which hold adjacent blocks of one
+// device, with one request, and return without waiting. The caller
+// must bwait for each. n must not be more than NSEG.
+void
+bwrite_private(struct buf **bs, int n)
+{
+  if(n > NSEG)
+    panic("bwrite_private");
+  for(int i = 0; i < n; i++){
+    if(bs[i]->dev != bs[0]->dev || bs[i]->blockno != bs[0]->blockno + i)
+      panic("bwrite_private");
+  }
+  bsubmit(bs, n, 1);
+}
+
+// Wait for bwrite_private of b to finish.
+void
+bwait(struct buf *b)
+{
+  if(b->disk)
+    bdevsw[b->dev].wait(b);
+}
+
+// Mark b to be written to disk later. Must be locked.
+// The buffer stays in the cache until it has been written.
+void
+bdwrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdwrite");
+
+  acquire(&bcache.lock);
+  if(!b->dirty){
+    b->dirty = 1;
+    bcache.ndirty++;
+  }
+  release(&bcache.lock);
+}
+
+// Take and lock up to n dirty buffers of dev, or of every device if
+// dev is -1, into bs sorted by device and block. With wait 0 only
+// buffers nobody uses are taken, so this never waits for a buffer.
+// Returns the number taken.
+static int
+bcollect(int dev, struct buf **bs, int n, int wait)
+{
+  struct bufpage *pg;
+  struct buf *b, *t;
+  int nb = 0, i;
+
+  acquire(&bcache.lock);
+  for(pg = bcache.pages; pg && nb < n; pg = pg->next){
+    for(b = pg->buf; b < pg->buf+BUFS_PER_PAGE && nb < n; b++){
+      if(!b->dirty || (dev >= 0 && b->dev != dev))
+        continue;
+      struct bucket *bk = bucket(b->dev, b->blockno);
+      acquire(&bk->lock);
+      if(wait || b->refcnt == 0){
+        if(b->refcnt++ == 0 && !wait)
+          acquiresleep(&b->lock); // unused, so this doesn't sleep
+        bs[nb++] = b;
+      }
+      release(&bk->lock);
+    }
+  }
+  release(&bcache.lock);
+
+  // Insertion sort, so the disk sees the writes in order.
+  for(i = 1; i < nb; i++){
+    t = bs[i];
+    int j = i;
+    for(; j > 0 && (bs[j-1]->dev > t->dev ||
+          (bs[j-1]->dev == t->dev && bs[j-1]->blockno > t->blockno)); j--)
+      bs[j] = bs[j-1];
+    bs[j] = t;
+  }
+
+  if(wait){
+    for(i = 0; i < nb; i++)
+      acquiresleep(&bs[i]->lock);
+  }
+  return nb;
+}
+
+// Write dirty buffers of dev, or of every device if dev is -1, a
+// sorted batch at a time, with one request per run of adjacent
+// blocks. With wait 1, write all of them, waiting for buffers in
+// use; the caller must not hold any buffer. With wait 0, write only
+// buffers nobody uses. Returns the number written.
+int
+bsync(int dev, int wait)
+{
+  struct buf *bs[BSYNC_BATCH];
+  int nb, i, k, n = 0;
+
+  while((nb = bcollect(dev, bs, BSYNC_BATCH, wait)) > 0){
+    n += nb;
+    for(i = 0; i < nb; i += k){
+      k = 1;
+      if(!bs[i]->dirty)
+        continue;
+      while(i + k < nb && k < NSEG && bs[i+k]->dirty &&
+            bs[i+k]->dev == bs[i]->dev && bs[i+k]->blockno == bs[i]->blockno + k)
+        k++;
+      bsubmit(&bs[i], k, 1);
+    }
+    for(i = 0; i < nb; i++){
+      bwait(bs[i]);
+      acquire(&bcache.lock);
+      if(bs[i]->dirty){
+        bs[i]->dirty = 0;
+        bcache.ndirty--;
+      }
+      release(&bcache.lock);
+      brelse(bs[i]);
+    }
+  }
+  return n;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(VIRTIO0_ID, b, 1);
+  bdev_rw(b, 1);
+}
+
+// Make every block written to dev so far durable, writing out its
+// dirty buffers first. The disks may cache writes, so callers that
+// need one write to land before another put a flush between them.
+// The caller must not hold any buffer.
+void
+bflush(uint dev)
+{
+  if(dev >= NBDEV || bdevsw[dev].flush == 0)
+    panic("bflush: no device");
+  bsync(dev, 1);
+  if(bdevsw[dev].flush() < 0)
+    panic("bflush: I/O error");
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it used, so recycling passes over it once.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bucket(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  b->referenced = 1;
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucket(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucket(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Copy the cache's counters to st.
+void
+bstat(struct bcachestat *st)
+{
+  struct bucket *bk;
 
+  st->hits = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    acquire(&bk->lock);
+    st->hits += bk->hits;
+    release(&bk->lock);
+  }
+  acquire(&bcache.lock);
+  st->misses = bcache.misses;
+  st->evictions = bcache.evictions;
+  st->ghosthits = bcache.ghosthits;
+  st->nbuf = bcache.nbuf;
+  st->nhot = bcache.nhot;
+  release(&bcache.lock);
+}
@@ -7,7 +7,27 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int referenced; // used since it was last passed over for recycling
+  int hot;     // in the hot queue rather than probation
+  struct buf *qprev; // replacement queue, protected by bcache.lock
+  struct buf *qnext;
+  int dirty;   // changed by bdwrite, not yet on disk; protected by bcache.lock
+  struct buf *prev; // hash bucket list
   struct buf *next;
+  uint queue;  // virtqueue the request went to
+  void (*done)(struct buf *); // if set, virtio_disk_intr calls it last on completion; it may free b
   uchar data[BSIZE];
 };
+
+// map block device number to its driver.
+// rw returns 0 on success, -1 if the block could not be transferred.
+// flush makes every write that rw finished durable.
+// submit, if set, starts moving n bufs of adjacent blocks with one
+// request and returns without waiting; the device calls b->done
+// for each buf when it is finished, and wait waits for one.
+struct bdevsw {
+  int (*rw)(struct buf *, int);
+  int (*flush)(void);
+  int (*submit)(struct buf **, int, int);
+  void (*wait)(struct buf *);
+};
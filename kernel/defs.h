@@ -3,12 +3,14 @@
 
 #include "types.h"
 
+struct bcachestat;
 struct buf;
 struct context;
 struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct RAIDRing;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -17,10 +19,20 @@ struct superblock;
 // bio.c
 void binit(void);
 struct buf *bread(uint, uint);
+void bread_async(uint, uint, int);
+void bread_range(uint, uint, int, struct buf **);
+void bwrite_private(struct buf **, int);
+struct buf *bgrab(uint, uint);
+void bwait(struct buf *);
+void bdwrite(struct buf *);
+int bsync(int, int);
+void bstat(struct bcachestat *);
 void brelse(struct buf *);
 void bwrite(struct buf *);
+void bflush(uint);
 void bpin(struct buf *);
 void bunpin(struct buf *);
+int bshrink(int);
 
 // console.c
 void consoleinit(void);
@@ -68,6 +80,7 @@ void ramdiskrw(struct buf *);
 void *kalloc(void);
 void kfree(void *);
 void kinit(void);
+uint64 kfreepages(void);
 
 // log.c
 void initlog(int, struct superblock *);
@@ -112,6 +125,15 @@ void yield(void);
 int either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void procdump(void);
+struct proc *kthread_create(char *, void (*)(void *), void *, int);
+
+// workqueue.c
+struct work;
+void workqueue_init(void);
+void init_work(struct work *, void (*)(struct work *));
+int queue_work(struct work *);
+int queue_work_long(struct work *);
+void flush_work(struct work *);
 
 // swtch.S
 void swtch(struct context *, struct context *);
@@ -191,9 +213,15 @@ void plic_complete(int);
 // virtio_disk.c
 void virtio_disk_init(int id, char *name);
 void virtio_disk_rw(int id, struct buf *, int);
+void virtio_disk_submit(int id, struct buf *, int);
+void virtio_disk_submit_range(int, struct buf **, int, int);
+void virtio_disk_wait(int id, struct buf *);
+void virtio_disk_flush(int id);
 void virtio_disk_intr(int id);
 void write_block(int diskn, int blockno, uchar *data);
 void read_block(int diskn, int blockno, uchar *data);
+void zero_blocks(int diskn, int blockno, int nblocks);
+int discard_blocks(int diskn, int blockno, int nblocks);
 
 // raid.c
 enum RAID_TYPE
@@ -202,7 +230,9 @@ enum RAID_TYPE
     RAID1,
     RAID0_1,
     RAID4,
-    RAID5
+    RAID5,
+    RAID10_NEAR,
+    RAID10_FAR
 };
 int init_raid(enum RAID_TYPE raid);
 int read_raid(int blkn, uchar *data);
@@ -211,6 +241,17 @@ int disk_fail_raid(int diskn);
 int disk_repaired_raid(int diskn);
 int info_raid(uint *blkn, uint *blks, uint *diskn);
 int destroy_raid();
+int raid_bdev_rw(struct buf *, int);
+int raid_bdev_flush(void);
+void raid_ring_release(struct proc *);
+void raid_root_init(void);
+int expand_raid(int diskn);
+int init_ring_raid(struct RAIDRing **ring);
+int enter_ring_raid(int to_submit, int min_complete);
+int trim_raid(int start, int count);
+
+// raid_latency.c
+void raid_latency_tick(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x) / sizeof((x)[0]))
@@ -218,6 +259,9 @@ int destroy_raid();
 #define VIRTIO0_ID 0
 #define VIRTIO_RAID_DISK_START (1)
 #define VIRTIO_RAID_DISK_END (DISKS)
+#define VIRTIO_RAID_MEMBERS (MEMBERS)
+#define VIRTIO_JOURNAL_DISK (JOURNAL)
+#define VIRTIO_DISK_END (VIRTIO_JOURNAL_DISK > VIRTIO_RAID_DISK_END ? VIRTIO_JOURNAL_DISK : VIRTIO_RAID_DISK_END)
 #define DISK_SIZE (DSK_SIZE)
 
 #endif
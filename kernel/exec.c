@@ -128,6 +128,10 @@ exec(char *path, char **argv)
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
 
+  // The RAID I/O rings belonged to the old image
+  if(p->raid_ring)
+    raid_ring_release(p);
+
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
@@ -26,7 +26,20 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint flags;
+  union {
+    uint addrs[NDIRECT+1];
+    struct {
+      struct extent ext[NIEXTENT];
+      uint extblock;
+      uint dindirect;
+    };
+  };
+
+  uint ra_next;       // block a sequential reader reads next
+  uint ra_window;     // blocks read ahead of it, 0 if not sequential
+  uint ra_issued;     // last block read ahead
+  uint goal;          // where to allocate the next data block, after the last one
 };
 
 // map major device number to device functions.
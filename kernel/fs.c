@@ -22,6 +22,11 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define RA_MIN 4   // first read-ahead window of a sequential reader, in blocks
+#define RA_MAX 32  // largest read-ahead window
+#define BGROUP 256 // blocks per group in the free-space summary
+#define BMAP_ALLOC 1 // bmap_alloc(): allocate missing blocks, zeroed
+#define BMAP_FILL  2 // same, but leave data blocks to the caller to fill
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb;
@@ -37,6 +42,111 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+// Free-space summary, built by fsinit() so that balloc() and
+// ialloc() need not scan the disk. The counts of a group change
+// only while its bitmap block is held, so whoever holds it sees
+// them exact. Inode hints are only hints; ialloc() scans again
+// before it gives up. It lives in kalloc'd pages sized from
+// sb.size: one of bitmap block counts, and as many of groups as
+// the file system needs.
+struct fgroup {
+  ushort nfree; // free blocks in the group
+  ushort first; // no block of the group below this one is free
+};
+
+#define GPP (PGSIZE / sizeof(struct fgroup)) // groups per page
+#define FSUM_MAX (PGSIZE / sizeof(uint) * BPB) // blocks the summary can cover
+#define NGPAGE ((FSUM_MAX / BGROUP + GPP - 1) / GPP)
+
+static struct {
+  struct spinlock lock;
+  uint ngroup;
+  uint *bfree;                  // free blocks per bitmap block
+  struct fgroup *gpage[NGPAGE]; // groups, GPP per page
+  uint ifree;     // free inodes
+  uint ifirst;    // usually no inode below this one is free
+} fsum;
+
+static struct fgroup*
+fgroup(uint g)
+{
+  return &fsum.gpage[g / GPP][g % GPP];
+}
+
+static int
+bisfree(struct buf *bp, uint b)
+{
+  return (bp->data[(b % BPB)/8] & (1 << (b % 8))) == 0;
+}
+
+// Count the free blocks and inodes.
+static void
+fsum_init(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint b, g, inum;
+
+  initlock(&fsum.lock, "fsum");
+  if(sb.size > FSUM_MAX)
+    panic("fsum_init: file system too big");
+  fsum.ngroup = (sb.size + BGROUP - 1) / BGROUP;
+  if((fsum.bfree = kalloc()) == 0)
+    panic("fsum_init: out of memory");
+  memset(fsum.bfree, 0, PGSIZE);
+  for(g = 0; g < fsum.ngroup; g += GPP){
+    if((fsum.gpage[g / GPP] = kalloc()) == 0)
+      panic("fsum_init: out of memory");
+    memset(fsum.gpage[g / GPP], 0, PGSIZE);
+  }
+  for(g = 0; g < fsum.ngroup; g++)
+    fgroup(g)->first = BGROUP;
+  bp = 0;
+  for(b = 0; b < sb.size; b++){
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    if(bisfree(bp, b)){
+      g = b / BGROUP;
+      fsum.bfree[b / BPB]++;
+      if(fgroup(g)->nfree++ == 0)
+        fgroup(g)->first = b % BGROUP;
+    }
+  }
+  if(bp)
+    brelse(bp);
+
+  fsum.ifirst = sb.ninodes;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0){
+      if(fsum.ifree++ == 0)
+        fsum.ifirst = inum;
+    }
+    brelse(bp);
+  }
+}
+
+// Note that block b was freed (delta 1) or allocated (delta -1).
+// Caller must hold b's bitmap block.
+static void
+fsum_block(uint b, int delta)
+{
+  uint g = b / BGROUP, off = b % BGROUP;
+
+  acquire(&fsum.lock);
+  fsum.bfree[b / BPB] += delta;
+  fgroup(g)->nfree += delta;
+  if(delta > 0 && off < fgroup(g)->first)
+    fgroup(g)->first = off;
+  else if(delta < 0 && off == fgroup(g)->first)
+    fgroup(g)->first = off + 1;
+  release(&fsum.lock);
+}
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +154,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  fsum_init(dev);
 }
 
 // Zero a block.
@@ -60,33 +171,98 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// The first group from g on, wrapping around, that has a free
+// block, or -1 if none has.
+static int
+bgroup(uint g)
+{
+  uint i, n;
+
+  acquire(&fsum.lock);
+  for(i = 0; i < fsum.ngroup; i += n, g = (g + n) % fsum.ngroup){
+    n = 1;
+    if(fsum.bfree[g * BGROUP / BPB] == 0){
+      // Nothing in this bitmap block, go to the next one.
+      n = min(BPB/BGROUP - g % (BPB/BGROUP), fsum.ngroup - g);
+    } else if(fgroup(g)->nfree > 0){
+      release(&fsum.lock);
+      return g;
+    }
+  }
+  release(&fsum.lock);
+  return -1;
+}
+
+// A free block in group g, whose bitmap block bp holds: goal if it
+// is free, else the next free one, else the first. 0 if none.
+static uint
+bscan(struct buf *bp, uint g, uint goal)
+{
+  uint b, first, end;
+
+  first = g * BGROUP + fgroup(g)->first;
+  end = min(g * BGROUP + BGROUP, sb.size);
+  if(goal < first)
+    goal = first;
+  for(b = goal; b < end; b++){
+    if(bisfree(bp, b))
+      return b;
+  }
+  for(b = first; b < goal; b++){
+    if(bisfree(bp, b))
+      return b;
+  }
+  return 0;
+}
+
+// Allocate a disk block without zeroing it: goal if it is free,
+// else one near it, so that a file growing block by block gets
+// a run of adjacent blocks. The free-space summary points at a
+// group with a free block, so this reads one bitmap block. The
+// caller must overwrite all of the block in this transaction.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc_nozero(uint dev, uint goal)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, i;
+  int g;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal >= sb.size)
+    goal = 0;
+  for(i = 0; i < fsum.ngroup; i++){
+    if((g = bgroup(goal / BGROUP)) < 0)
+      break;
+    if(g != goal / BGROUP)
+      goal = g * BGROUP;
+    bp = bread(dev, BBLOCK(goal, sb));
+    if((b = bscan(bp, g, goal)) != 0){
+      bp->data[(b % BPB)/8] |= 1 << (b % 8);  // Mark block in use.
+      log_write(bp);
+      fsum_block(b, -1);
+      brelse(bp);
+      return b;
     }
+    // Another process took the last one.
     brelse(bp);
+    goal = (g + 1) % fsum.ngroup * BGROUP;
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate a zeroed disk block near goal.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b;
+
+  if((b = balloc_nozero(dev, goal)) != 0)
+    bzero(dev, b);
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -101,6 +277,7 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  fsum_block(b, 1);
   brelse(bp);
 }
 
@@ -198,21 +375,35 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  int inum, pass, nfree;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
+  // Start at the hint; from 1 on if that finds nothing.
+  acquire(&fsum.lock);
+  inum = fsum.ifirst;
+  nfree = fsum.ifree;
+  release(&fsum.lock);
+  for(pass = 0; pass < 2 && nfree > 0; pass++, inum = 1){
+    for(; inum < sb.ninodes; inum++){
+      bp = bread(dev, IBLOCK(inum, sb));
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        if(type != T_DEVICE)
+          dip->flags = I_EXTENTS;
+        log_write(bp);   // mark it allocated on the disk
+        acquire(&fsum.lock);
+        fsum.ifree--;
+        if(fsum.ifirst <= inum)
+          fsum.ifirst = inum + 1;
+        release(&fsum.lock);
+        brelse(bp);
+        return iget(dev, inum);
+      }
       brelse(bp);
-      return iget(dev, inum);
     }
-    brelse(bp);
   }
   printf("ialloc: no inodes\n");
   return 0;
@@ -232,7 +423,10 @@ iupdate(struct inode *ip)
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
-  dip->minor = ip->minor;
+  if(ip->type == T_DEVICE)
+    dip->minor = ip->minor;
+  else
+    dip->flags = ip->flags;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
@@ -271,6 +465,10 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_next = 0;
+  ip->ra_window = 0;
+  ip->ra_issued = 0;
+  ip->goal = 0;
   release(&itable.lock);
 
   return ip;
@@ -305,7 +503,11 @@ ilock(struct inode *ip)
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
-    ip->minor = dip->minor;
+    ip->minor = ip->flags = 0;
+    if(dip->type == T_DEVICE)
+      ip->minor = dip->minor;
+    else
+      ip->flags = dip->flags;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
@@ -351,6 +553,11 @@ iput(struct inode *ip)
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    acquire(&fsum.lock);
+    fsum.ifree++;
+    if(ip->inum < fsum.ifirst)
+      fsum.ifirst = ip->inum;
+    release(&fsum.lock);
 
     releasesleep(&ip->lock);
 
@@ -375,19 +582,162 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// Inodes with I_EXTENTS, which ialloc() makes of all but
+// devices, list their blocks as extents instead: runs of adjacent disk blocks in
+// file order, NIEXTENT in ip->ext[] and then NEXTENT in block
+// ip->extblock. Files have no holes, so the extents cover the
+// file from block 0 on, and a new block extends the last one
+// when balloc() finds the block after it free. Once all extents
+// are used, the rest of the file is listed through the double-
+// indirect block ip->dindirect.
+
+// Allocate a data block of ip near goal, zeroed unless alloc
+// is BMAP_FILL, and allocate the next one after it.
+static uint
+dalloc(struct inode *ip, uint goal, int alloc)
+{
+  uint addr;
+
+  if(alloc == BMAP_FILL)
+    addr = balloc_nozero(ip->dev, goal);
+  else
+    addr = balloc(ip->dev, goal);
+  if(addr)
+    ip->goal = addr + 1;
+  return addr;
+}
+
+// Block bn of the part of ip past its extents, listed in the
+// double-indirect block.
+static uint
+dindmap(struct inode *ip, uint bn, int alloc)
+{
+  uint addr, level, *a;
+  uint idx[2] = { bn / NINDIRECT, bn % NINDIRECT };
+  struct buf *bp;
+
+  if(bn >= NINDIRECT * NINDIRECT)
+    return 0;
+  if((addr = ip->dindirect) == 0){
+    if(!alloc || (addr = balloc(ip->dev, 0)) == 0)
+      return 0;
+    ip->dindirect = addr;
+  }
+  for(level = 0; level < 2; level++){
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    if((addr = a[idx[level]]) == 0 && alloc){
+      if(level == 1)
+        addr = dalloc(ip, ip->goal, alloc);
+      else
+        addr = balloc(ip->dev, 0);
+      if(addr){
+        a[idx[level]] = addr;
+        log_write(bp);
+      }
+    }
+    brelse(bp);
+    if(addr == 0)
+      return 0;
+  }
+  return addr;
+}
+
+// bmap for inodes with I_EXTENTS. Lookups take O(#extents).
+static uint
+emap(struct inode *ip, uint bn, int alloc)
+{
+  struct extent *e, *last;
+  struct buf *bp;
+  uint base, addr, i;
+
+  // Find the extent holding bn.
+  bp = 0;
+  last = 0;
+  base = 0;
+  for(i = 0; i < NIEXTENT + NEXTENT; i++){
+    if(i < NIEXTENT){
+      e = &ip->ext[i];
+    } else {
+      if(ip->extblock == 0)
+        break;
+      if(bp == 0)
+        bp = bread(ip->dev, ip->extblock);
+      e = (struct extent*)bp->data + (i - NIEXTENT);
+    }
+    if(e->len == 0)
+      break;
+    if(bn < base + e->len){
+      addr = e->start + (bn - base);
+      goto out;
+    }
+    base += e->len;
+    last = e;
+  }
+
+  addr = 0;
+  if(ip->dindirect == 0){
+    // Only the block right after the extents can be new.
+    if(!alloc || bn != base)
+      goto out;
+    if((addr = dalloc(ip, last ? last->start + last->len : ip->goal, alloc)) == 0)
+      goto out;
+    if(last && addr == last->start + last->len){
+      last->len++;
+      if(i > NIEXTENT)
+        log_write(bp);
+      goto out;
+    }
+    if(i < NIEXTENT + NEXTENT){
+      // Start a new extent.
+      if(i >= NIEXTENT && ip->extblock == 0){
+        if((ip->extblock = balloc(ip->dev, 0)) == 0){
+          bfree(ip->dev, addr);
+          addr = 0;
+          goto out;
+        }
+        bp = bread(ip->dev, ip->extblock);
+      }
+      e = i < NIEXTENT ? &ip->ext[i] : (struct extent*)bp->data + (i - NIEXTENT);
+      e->start = addr;
+      e->len = 1;
+      if(i >= NIEXTENT)
+        log_write(bp);
+      goto out;
+    }
+    // All extents are used.
+    bfree(ip->dev, addr);
+  }
+  if(bp){
+    brelse(bp);
+    bp = 0;
+  }
+  addr = dindmap(ip, bn - base, alloc);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, or returns 0
+// if alloc is 0. A data block allocated with BMAP_FILL is not
+// zeroed; the caller overwrites all of it.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap_alloc(struct inode *ip, uint bn, int alloc)
 {
   uint addr, *a;
   struct buf *bp;
 
+  if(ip->flags & I_EXTENTS)
+    return emap(ip, bn, alloc);
+
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc){
+      addr = dalloc(ip, ip->goal, alloc);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,15 +749,17 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      if(!alloc)
+        return 0;
+      addr = balloc(ip->dev, 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
     }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    if((addr = a[bn]) == 0 && alloc){
+      addr = dalloc(ip, ip->goal, alloc);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -420,6 +772,67 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return bmap_alloc(ip, bn, BMAP_ALLOC);
+}
+
+// Free the blocks listed in block addr, down to depth more
+// levels of indirection, then addr itself.
+static void
+bfree_tree(int dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  if(depth > 0){
+    bp = bread(dev, addr);
+    a = (uint*)bp->data;
+    for(j = 0; j < NINDIRECT; j++){
+      if(a[j])
+        bfree_tree(dev, a[j], depth - 1);
+    }
+    brelse(bp);
+  }
+  bfree(dev, addr);
+}
+
+// Free the blocks of e, and clear it.
+static void
+efree(int dev, struct extent *e)
+{
+  uint b;
+
+  for(b = e->start; b < e->start + e->len; b++)
+    bfree(dev, b);
+  e->start = e->len = 0;
+}
+
+// Truncate an inode with I_EXTENTS.
+static void
+etrunc(struct inode *ip)
+{
+  struct buf *bp;
+  int i;
+
+  for(i = 0; i < NIEXTENT; i++)
+    efree(ip->dev, &ip->ext[i]);
+  if(ip->extblock){
+    bp = bread(ip->dev, ip->extblock);
+    for(i = 0; i < NEXTENT; i++)
+      efree(ip->dev, (struct extent*)bp->data + i);
+    brelse(bp);
+    bfree(ip->dev, ip->extblock);
+    ip->extblock = 0;
+  }
+  if(ip->dindirect){
+    bfree_tree(ip->dev, ip->dindirect, 2);
+    ip->dindirect = 0;
+  }
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -429,6 +842,13 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->flags & I_EXTENTS){
+    etrunc(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -464,35 +884,103 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Number of blocks from block bn of ip on, at most max and NSEG,
+// that follow addr, the address of bn, on disk. With alloc, missing
+// blocks are allocated, which usually puts them right after addr.
+static uint
+bmap_run(struct inode *ip, uint bn, uint addr, uint max, int alloc)
+{
+  uint n;
+
+  for(n = 1; n < max && n < NSEG; n++){
+    if(bmap_alloc(ip, bn + n, alloc) != addr + n)
+      break;
+  }
+  return n;
+}
+
+// readi is about to read blocks bn to bn+n-1 of ip. While the reads
+// are sequential, start reading the blocks after them without
+// waiting, in a window that doubles up to RA_MAX blocks.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn, uint n)
+{
+  uint from, to, last, addr, start, nrun;
+
+  if(bn + n == ip->ra_next)
+    return; // nothing past what was read last time
+  if(bn == ip->ra_next || bn + 1 == ip->ra_next){
+    ip->ra_window = ip->ra_window == 0 ? RA_MIN : ip->ra_window * 2;
+    if(ip->ra_window > RA_MAX)
+      ip->ra_window = RA_MAX;
+  } else {
+    // Random access, start over.
+    ip->ra_window = 0;
+    ip->ra_issued = bn + n - 1;
+  }
+  ip->ra_next = bn + n;
+  if(ip->ra_window == 0)
+    return;
+
+  from = ip->ra_issued >= bn + n ? ip->ra_issued + 1 : bn + n;
+  last = (ip->size - 1) / BSIZE;
+  to = min(bn + n - 1 + ip->ra_window, last);
+
+  // One request per run of blocks that are adjacent on disk.
+  start = nrun = 0;
+  for(; from <= to; from++){
+    if((addr = bmap_alloc(ip, from, 0)) == 0)
+      break;
+    if(nrun > 0 && addr != start + nrun){
+      bread_async(ip->dev, start, nrun);
+      nrun = 0;
+    }
+    if(nrun++ == 0)
+      start = addr;
+    ip->ra_issued = from;
+  }
+  if(nrun > 0)
+    bread_async(ip->dev, start, nrun);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Blocks that are adjacent on disk are read with one request.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, bn, addr, nb, i;
+  struct buf *bs[NSEG];
+  int err = 0;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+  for(tot=0; tot<n && !err; ){
+    bn = off/BSIZE;
+    addr = bmap(ip, bn);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
-      tot = -1;
-      break;
+    nb = bmap_run(ip, bn, addr, (off + n - tot - 1)/BSIZE - bn + 1, 0);
+    readahead(ip, bn, nb);
+    bread_range(ip->dev, addr, nb, bs);
+    for(i = 0; i < nb; i++){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyout(user_dst, dst, bs[i]->data + (off % BSIZE), m) == -1) {
+        err = 1;
+        break;
+      }
+      tot += m, off += m, dst += m;
     }
-    brelse(bp);
+    for(i = 0; i < nb; i++)
+      brelse(bs[i]);
   }
-  return tot;
+  return err ? -1 : tot;
 }
 
 // Write data to inode.
@@ -502,29 +990,57 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
+// Blocks that are adjacent on disk are read with one request.
+// Blocks past the end of the file that are written whole are
+// neither zeroed nor read, as nothing of them was visible.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, bn, addr, nb, i, max, fresh;
+  struct buf *bs[NSEG];
+  int err = 0, fill;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(!(ip->flags & I_EXTENTS) && off + n > MAXFILE*BSIZE)
     return -1;
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+  fresh = (ip->size + BSIZE - 1) / BSIZE; // first block past the end
+  for(tot=0; tot<n && !err; ){
+    bn = off/BSIZE;
+    max = (off + n - tot - 1)/BSIZE - bn + 1;
+    fill = bn >= fresh && off % BSIZE == 0 && n - tot >= BSIZE;
+    if(fill)
+      max = (n - tot) / BSIZE; // whole blocks only
+    else if(fresh > bn && fresh - bn < max)
+      max = fresh - bn; // up to the ones that can be filled
+    addr = bmap_alloc(ip, bn, fill ? BMAP_FILL : BMAP_ALLOC);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
-      break;
+    nb = bmap_run(ip, bn, addr, max, fill ? BMAP_FILL : BMAP_ALLOC);
+    if(fill){
+      for(i = 0; i < nb; i++)
+        bs[i] = bgrab(ip->dev, addr + i);
+    } else {
+      bread_range(ip->dev, addr, nb, bs);
     }
-    log_write(bp);
-    brelse(bp);
+    for(i = 0; i < nb; i++){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyin(bs[i]->data + (off % BSIZE), user_src, src, m) == -1) {
+        // Don't leave another block's old data in grabbed ones,
+        // in the cache or on the disk; they stay allocated.
+        for(; fill && i < nb; i++){
+          memset(bs[i]->data, 0, BSIZE);
+          log_write(bs[i]);
+        }
+        err = 1;
+        break;
+      }
+      log_write(bs[i]);
+      tot += m, off += m, src += m;
+    }
+    for(i = 0; i < nb; i++)
+      brelse(bs[i]);
   }
 
   if(off > ip->size)
@@ -532,7 +1048,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->addrs[] or extended ip->ext[].
   iupdate(ip);
 
   return tot;
@@ -26,16 +26,39 @@ struct superblock {
 
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT)  // without I_EXTENTS
 
-// On-disk inode structure
+// A run of len adjacent disk blocks from start on.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NIEXTENT 5  // extents in an inode
+#define NEXTENT (BSIZE / sizeof(struct extent))  // in its extent block
+
+// Inode flags
+#define I_EXTENTS 0x1  // blocks are mapped by extents, see bmap()
+
+// On-disk inode structure. Only devices have a minor number, so other
+// inodes keep their flags there; images made before extents have 0.
 struct dinode {
   short type;           // File type
   short major;          // Major device number (T_DEVICE only)
-  short minor;          // Minor device number (T_DEVICE only)
+  union {
+    short minor;        // Minor device number (T_DEVICE only)
+    short flags;        // I_EXTENTS, other types
+  };
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  union {
+    uint addrs[NDIRECT+1];   // Data block addresses
+    struct {
+      struct extent ext[NIEXTENT]; // Runs of data blocks, in file order
+      uint extblock;     // Block of NEXTENT more extents
+      uint dindirect;    // Double-indirect block for the rest
+    };
+  };
 };
 
 // Inodes per block.
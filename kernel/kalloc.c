@@ -11,6 +11,8 @@
 
 void freerange(void *pa_start, void *pa_end);
 
+#define BSHRINK_PAGES 8 // pages asked from the buffer cache when memory runs out
+
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
@@ -21,6 +23,7 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  uint64 nfree; // pages on freelist
 } kmem;
 
 void
@@ -59,24 +62,43 @@ kfree(void *pa)
   acquire(&kmem.lock);
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When memory runs out, the buffer cache gives some back: bshrink
+// takes bcache.lock and bucket locks, so the caller must not hold
+// those, nor a lock that is taken while holding them. A p->lock is
+// fine (allocproc holds one), since bio.c never calls wakeup under
+// its locks.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(int tries = 0; ; tries++){
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    release(&kmem.lock);
+    if(r || tries > 0 || bshrink(BSHRINK_PAGES) == 0)
+      break;
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Number of free pages.
+uint64
+kfreepages(void)
+{
+  return kmem.nfree;
+}
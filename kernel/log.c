@@ -10,10 +10,10 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only commits when there are no FS system
+// calls active in it. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system call's
+// updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
@@ -21,35 +21,87 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// There are two transactions in memory: the open one, which new
+// system calls join, and the one being committed. A commit copies
+// its blocks into private buffers while no system call runs, and
+// from then on new system calls go on in the other transaction
+// while the copies are written to the log. Commits themselves
+// happen one at a time, in order.
+//
+// The log is a physical re-do log containing disk blocks. Its
+// first block says where the oldest commit record not yet
+// installed starts; the rest is a ring of commit records:
+//   header block, containing a sequence number and block #s for
+//     block A, B, C, ...
 //   block A
 //   block B
-//   block C
 //   ...
-// Log appends are synchronous.
+// A commit only appends its record; committed blocks stay pinned
+// in the cache. Installing them at their home locations waits for
+// a checkpoint, when the ring is full or CKPT_TICKS after the last
+// one, so a bitmap or inode block that many commits changed is
+// written home once. Recovery replays the records from the first
+// block on, for as long as their sequence numbers follow.
+//
+// A commit writes its header and log blocks at once, NSEG adjacent
+// ones per request, and waits for one flush. The header carries a
+// checksum of the record, so recovery tells a record that did not
+// all land from a committed one, and its blocks need no ordering
+// among themselves. The disk may cache writes, so flushes
+// order a checkpoint's home locations and the first block.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+#define TXNBLOCKS (MAXOPBLOCKS*3) // max data blocks in one commit record
+#define CKPT_TICKS 100            // checkpoint at the first commit after this long
+
+// Contents of the first block of the log.
+struct logsuper {
+  int seq;  // commit record to replay first
+  int head; // where it starts in the ring
+};
+
+// Contents of the header block of a commit record, also used
+// to keep track in memory of logged block# before commit.
 struct logheader {
+  int seq; // commit number, records follow each other in order
   int n;
-  int block[LOGSIZE];
+  uint sum; // checksum of the record, see checksum()
+  int block[TXNBLOCKS];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
-  int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int size;        // blocks in the ring
+  int cap;         // max data blocks in one transaction
   int dev;
-  struct logheader lh;
+  int seq;         // number of the next commit
+  int head;        // ring position of the oldest record not installed
+  int tail;        // ring position of the next record
+  int used;        // ring blocks from head to tail
+  uint ckpt_ticks; // ticks at the last checkpoint
+  int outstanding; // how many FS sys calls are executing.
+  int committing;  // a commit is in progress.
+  int copying;     // in copy_trans(), please wait.
+  int cur;         // lh[cur] is the open transaction
+  struct logheader lh[2];
 };
 struct log log;
 
+// Private copies of the committing transaction's blocks,
+// and the header of its record.
+static struct buf copies[TXNBLOCKS];
+static struct buf head;
+
+// The newest committed version of each block in the ring, for the
+// next checkpoint to install. Each also holds a pin on its cache
+// buffer, as the home location is out of date.
+static struct {
+  int n;
+  struct buf b[LOGSIZE];
+} installs;
+
 static void recover_from_log(void);
-static void commit();
+static void commit(struct logheader *);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -59,67 +111,265 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
+  log.cap = log.size - 1 < TXNBLOCKS ? log.size - 1 : TXNBLOCKS;
+  if(log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  if(log.size > LOGSIZE)
+    panic("initlog: log too big");
   log.dev = dev;
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Disk block of ring position pos.
+static int
+ring(int pos)
+{
+  return log.start + 1 + pos % log.size;
+}
+
+// FNV-1a of len bytes, continuing from sum. A record's sum
+// starts from its number and covers its block #s and log blocks,
+// so a torn header or blocks left by an older record do not match.
+static uint
+checksum(uint sum, void *p, int len)
+{
+  uchar *data = p;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    sum ^= data[i];
+    sum *= 16777619u;
+  }
+  return sum;
+}
+
+// Write the n bufs in bs to their blocks, with one request per run
+// of adjacent blocks, and wait for all of them. Sorts bs.
 static void
-install_trans(int recovering)
+write_bufs(struct buf **bs, int n)
 {
-  int tail;
+  struct buf *t;
+  int i, j, k;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  // Insertion sort by block, so runs can be merged.
+  for(i = 1; i < n; i++){
+    t = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > t->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = t;
+  }
+
+  for(i = 0; i < n; i += k){
+    for(k = 1; i + k < n && k < NSEG && bs[i+k]->blockno == bs[i]->blockno + k; k++)
+      ;
+    bwrite_private(&bs[i], k);
   }
+  for(i = 0; i < n; i++)
+    bwait(bs[i]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy t's blocks from the cache. No FS system call may run.
 static void
-read_head(void)
+copy_trans(struct logheader *t)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  for (i = 0; i < t->n; i++) {
+    struct buf *from = bread(log.dev, t->block[i]); // cache block
+    memmove(copies[i].data, from->data, BSIZE);
+    brelse(from);
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write t's record to the ring at the tail: its header, then the
+// copies of its blocks, all at once. This is the true point at
+// which t commits, once the disk has it all.
 static void
-write_head(void)
+write_log(struct logheader *t)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct buf *bs[TXNBLOCKS+1];
+  struct logheader *hb = (struct logheader *) (head.data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  t->sum = checksum(2166136261u ^ t->seq, t->block, t->n * sizeof(int));
+  for (i = 0; i < t->n; i++) {
+    copies[i].dev = log.dev;
+    copies[i].blockno = ring(log.tail + 1 + i);
+    bs[i] = &copies[i];
+    t->sum = checksum(t->sum, copies[i].data, BSIZE);
+  }
+
+  memset(head.data, 0, BSIZE);
+  hb->seq = t->seq;
+  hb->n = t->n;
+  hb->sum = t->sum;
+  for (i = 0; i < t->n; i++) {
+    hb->block[i] = t->block[i];
   }
+  head.dev = log.dev;
+  head.blockno = ring(log.tail);
+  bs[t->n] = &head;
+  write_bufs(bs, t->n + 1);
+}
+
+// Write the first block of the log.
+static void
+write_super(int seq)
+{
+  struct buf *buf = bread(log.dev, log.start);
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+  ls->seq = seq;
+  ls->head = log.head;
   bwrite(buf);
   brelse(buf);
 }
 
+// Install every block in the ring at its home location and drop
+// the records. seq is the number of the record written next.
+static void
+checkpoint(int seq)
+{
+  struct buf *bs[LOGSIZE];
+  int i;
+
+  if (log.used == 0)
+    return;
+  for (i = 0; i < installs.n; i++)
+    bs[i] = &installs.b[i];
+  write_bufs(bs, installs.n);
+  bflush(log.dev); // Home locations before the records are dropped
+  log.head = log.tail;
+  log.used = 0;
+  write_super(seq);
+  bflush(log.dev); // Dropped before the ring space is reused
+  for (i = 0; i < installs.n; i++) {
+    struct buf *b = bread(log.dev, installs.b[i].blockno);
+    bunpin(b);
+    brelse(b);
+  }
+  installs.n = 0;
+}
+
+// Keep the copies of t's blocks for the next checkpoint. A block
+// already there drops the pin log_write() took for t.
+static void
+absorb(struct logheader *t)
+{
+  int i, j;
+
+  for (i = 0; i < t->n; i++) {
+    for (j = 0; j < installs.n; j++) {
+      if (installs.b[j].blockno == t->block[i])
+        break;
+    }
+    if (j == installs.n) {
+      if (installs.n == LOGSIZE)
+        panic("absorb");
+      installs.b[j].dev = log.dev;
+      installs.b[j].blockno = t->block[i];
+      installs.n++;
+    } else {
+      struct buf *b = bread(log.dev, t->block[i]);
+      bunpin(b);
+      brelse(b);
+    }
+    memmove(installs.b[j].data, copies[i].data, BSIZE);
+  }
+}
+
+// Read the header of the record at ring position pos into t.
+// Returns 0 unless it is record seq.
+static int
+read_head(int pos, int seq, struct logheader *t)
+{
+  struct buf *buf = bread(log.dev, ring(pos));
+  struct logheader *lh = (struct logheader *) (buf->data);
+  int i, ok;
+
+  ok = lh->seq == seq && lh->n > 0 && lh->n <= log.cap;
+  if (ok) {
+    t->seq = lh->seq;
+    t->n = lh->n;
+    t->sum = lh->sum;
+    for (i = 0; i < t->n; i++) {
+      t->block[i] = lh->block[i];
+    }
+  }
+  brelse(buf);
+  return ok;
+}
+
+// Read the log blocks of the record t at ring position pos.
+// Returns 0 unless all of them made it to disk.
+static int
+check_trans(int pos, struct logheader *t)
+{
+  int tail, first;
+  uint sum = checksum(2166136261u ^ t->seq, t->block, t->n * sizeof(int));
+
+  // All log blocks at once, in two runs if the record wraps.
+  first = log.size - (pos + 1) % log.size;
+  if (first > t->n)
+    first = t->n;
+  bread_async(log.dev, ring(pos + 1), first);
+  if (first < t->n)
+    bread_async(log.dev, ring(pos + 1 + first), t->n - first);
+  for (tail = 0; tail < t->n; tail++) {
+    struct buf *lbuf = bread(log.dev, ring(pos+tail+1));
+    sum = checksum(sum, lbuf->data, BSIZE);
+    brelse(lbuf);
+  }
+  return sum == t->sum;
+}
+
+// Copy the blocks of the record t at ring position pos to their
+// home locations after a crash. check_trans() read them.
+static void
+replay_trans(int pos, struct logheader *t)
+{
+  int tail;
+
+  for (tail = 0; tail < t->n; tail++) {
+    struct buf *lbuf = bread(log.dev, ring(pos+tail+1)); // read log block
+    struct buf *dbuf = bgrab(log.dev, t->block[tail]); // dst
+    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+    bdwrite(dbuf);  // written by the bflush that follows
+    brelse(lbuf);
+    brelse(dbuf);
+  }
+}
+
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf = bread(log.dev, log.start);
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+  struct logheader *t = &log.lh[0];
+  int seq = ls->seq, pos = ls->head, used, n = 0;
+
+  brelse(buf);
+  if (pos < 0 || pos >= log.size)
+    pos = 0; // never written
+  for (used = 0; read_head(pos, seq, t) && used + t->n + 1 <= log.size &&
+                check_trans(pos, t); used += t->n + 1) {
+    replay_trans(pos, t); // if committed, copy from log to disk
+    pos = (pos + t->n + 1) % log.size;
+    seq++;
+    n++;
+  }
+  log.seq = seq;
+  log.head = log.tail = pos;
+  log.used = 0;
+  if (n > 0) {
+    bflush(log.dev);
+    write_super(seq); // drop the replayed records
+    bflush(log.dev);
+  }
+  log.lh[0].n = 0;
+  log.lh[1].n = 0;
+  log.cur = 0;
+  log.ckpt_ticks = ticks;
 }
 
 // called at the start of each FS system call.
@@ -128,9 +378,9 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh[log.cur].n + (log.outstanding+1)*MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -141,20 +391,36 @@ begin_op(void)
   }
 }
 
+// Close the open transaction and start committing it, if it
+// has blocks and no commit is in progress. Returns it, or 0.
+// Caller must hold log.lock, and outstanding must be 0.
+static struct logheader*
+start_commit(void)
+{
+  struct logheader *t = &log.lh[log.cur];
+
+  if(log.committing || t->n == 0)
+    return 0;
+  t->seq = log.seq++;
+  log.committing = 1;
+  log.copying = 1;
+  log.cur ^= 1;
+  return t;
+}
+
 // called at the end of each FS system call.
 // commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct logheader *t = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
+  if(log.copying)
+    panic("log.copying");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    t = start_commit();
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -163,43 +429,47 @@ end_op(void)
   }
   release(&log.lock);
 
-  if(do_commit){
+  while(t){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
+    commit(t);
     acquire(&log.lock);
+    t->n = 0;
     log.committing = 0;
+    // The open transaction may have ended during the commit.
+    if(log.outstanding == 0)
+      t = start_commit();
+    else
+      t = 0;
     wakeup(&log);
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
 static void
-write_log(void)
+commit(struct logheader *t)
 {
-  int tail;
+  uint now;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
-}
+  copy_trans(t);   // Copy modified blocks from the cache
+  acquire(&log.lock);
+  log.copying = 0; // New FS sys calls go on in the other transaction
+  wakeup(&log);
+  release(&log.lock);
 
-static void
-commit()
-{
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&tickslock);
+  now = ticks;
+  release(&tickslock);
+  if (log.used + t->n + 1 > log.size || now - log.ckpt_ticks >= CKPT_TICKS) {
+    checkpoint(t->seq); // Make room, or catch up with an idle log
+    log.ckpt_ticks = now;
   }
+
+  write_log(t);    // Write the record to the ring -- the real commit
+  bflush(log.dev); // Durable before end_op() returns
+  log.tail = (log.tail + t->n + 1) % log.size;
+  log.used += t->n + 1;
+  absorb(t);       // Install at the next checkpoint
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -215,22 +485,23 @@ void
 log_write(struct buf *b)
 {
   int i;
+  struct logheader *t;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  t = &log.lh[log.cur];
+  if (t->n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < t->n; i++) {
+    if (t->block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  t->block[i] = b->blockno;
+  if (i == t->n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    t->n++;
   }
   release(&log.lock);
 }
-
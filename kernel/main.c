@@ -30,7 +30,7 @@ main()
     fileinit();      // file table
     virtio_disk_init(VIRTIO0_ID, "program_disk"); // emulated hard disk 0, with programs
 
-    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++) {
+    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_DISK_END; i++) {
       char name[30] = {0};
       strcat(name, "disk_");
       itoa(i, 10, name);
@@ -40,6 +40,7 @@ main()
 
     init_raid_device(); // init raid device
     userinit();      // first user process
+    workqueue_init(); // kernel worker threads
 
     __sync_synchronize();
     started = 1;
@@ -68,6 +68,8 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   RAIDRING (p->raid_ring->ring, only after init_ring_raid)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define RAIDRING (TRAPFRAME - PGSIZE)
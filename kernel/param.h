@@ -4,10 +4,19 @@
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
-#define ROOTDEV       1  // device number of file system root disk
+#define DISKDEV       1  // device number of the program disk
+#define RAIDDEV       2  // device number of the RAID volume
+#define NBDEV         3  // maximum block device number
+#if defined(ROOTRAID) && ROOTRAID >= 0
+#define ROOTDEV       RAIDDEV  // device number of file system root disk
+#else
+#define ROOTDEV       DISKDEV  // device number of file system root disk
+#endif
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      (MAXOPBLOCKS*6)  // blocks in on-disk log, a ring of commit records
+#define NBUF         (LOGSIZE*3)  // minimum size of disk block cache, the log pins up to 2*LOGSIZE
+#define BCACHE_DIV    4  // disk block cache grows to at most 1/BCACHE_DIV of RAM
+#define NSEG          8  // max blocks moved by one disk request
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
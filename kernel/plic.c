@@ -15,7 +15,7 @@ plicinit(void)
   *(uint32*)(PLIC + UART0_IRQ*4) = 1;
   *(uint32*)(PLIC + VIRTIO0_IRQ*4) = 1;
 
-  for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++) {
+  for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_DISK_END; i++) {
     *(uint32*)(PLIC + VIRTIOX_IRQ(i)*4) = 1;
   }
 }
@@ -28,7 +28,7 @@ plicinithart(void)
   // set enable bits for this hart's S-mode
   // for the uart and virtio disk.
   uint32 enable_bits = (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
-  for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++) {
+  for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_DISK_END; i++) {
     enable_bits |= (1 << VIRTIOX_IRQ(i));
   }
 
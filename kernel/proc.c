@@ -16,6 +16,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthread_start(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -124,6 +125,7 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->affinity = -1;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -168,6 +170,11 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->raid_ra_next = 0;
+  p->raid_ra_issued = 0;
+  p->raid_ra_window = 0;
+  p->kthread_fn = 0;
+  p->kthread_arg = 0;
   p->state = UNUSED;
 }
 
@@ -212,6 +219,9 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  pte_t *pte = walk(pagetable, RAIDRING, 0);
+  if(pte && (*pte & PTE_V))
+    uvmunmap(pagetable, RAIDRING, 1, 0); // freed by raid_ring_release()
   uvmfree(pagetable, sz);
 }
 
@@ -254,6 +264,34 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread running fn(arg). It has a kernel stack but
+// no user memory, and runs only on the given CPU, or on any if cpu
+// is -1. fn must not return.
+struct proc*
+kthread_create(char *name, void (*fn)(void *), void *arg, int cpu)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread_create");
+
+  // Never goes to user space.
+  proc_freepagetable(p->pagetable, 0);
+  p->pagetable = 0;
+  kfree((void*)p->trapframe);
+  p->trapframe = 0;
+
+  p->kthread_fn = fn;
+  p->kthread_arg = arg;
+  p->affinity = cpu;
+  p->context.ra = (uint64)kthread_start;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+
+  release(&p->lock);
+  return p;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -365,6 +403,9 @@ exit(int status)
   end_op();
   p->cwd = 0;
 
+  if(p->raid_ring)
+    raid_ring_release(p);
+
   acquire(&wait_lock);
 
   // Give any children to init.
@@ -446,6 +487,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
   for(;;){
@@ -454,7 +496,7 @@ scheduler(void)
 
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
+      if(p->state == RUNNABLE && (p->affinity < 0 || p->affinity == id)) {
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
@@ -524,12 +566,29 @@ forkret(void)
     // regular process (e.g., because it calls sleep), and thus cannot
     // be run from main().
     first = 0;
+#if ROOTDEV == RAIDDEV
+    raid_root_init();
+#endif
     fsinit(ROOTDEV);
   }
 
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthread_start.
+static void
+kthread_start(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kthread_fn(p->kthread_arg);
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -593,6 +652,11 @@ kill(int pid)
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
+    if(p->pid == pid && p->kthread_fn){
+      // Kernel threads run until shutdown.
+      release(&p->lock);
+      return -1;
+    }
     if(p->pid == pid){
       p->killed = 1;
       if(p->state == SLEEPING){
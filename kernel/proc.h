@@ -104,4 +104,11 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  uint64 raid_ra_next;         // read_raid block that continues the sequential stream
+  uint64 raid_ra_issued;       // last block already prefetched for the stream
+  uint raid_ra_window;         // read-ahead window in blocks, 0 if not sequential
+  struct RAIDRingState *raid_ring; // I/O rings from init_ring_raid, 0 if none
+  int affinity;                // CPU the process must run on, -1 for any
+  void (*kthread_fn)(void *);  // Body of a kernel thread, 0 for user processes
+  void *kthread_arg;
 };
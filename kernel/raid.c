@@ -3,6 +3,7 @@
 #include "fs.h"
 #include "param.h"
 #include "proc.h"
+#include "buf.h"
 
 // What if multiple processes call raid_init?
 static struct RAIDDevice raid_device;
@@ -60,6 +61,15 @@ int load_metadata(struct RAIDSuperblock **metadata)
             kfree(data);
             return -1;
         }
+        // Finish interrupted RAID4/5 writes before anyone reads the array
+        raid_journal_load(superblock);
+
+        // gate_lock keeps a second loader from restoring the reshape
+        // backup again after the first one has committed
+        acquiresleep(&raid_device.gate_lock);
+        if (raid_device.superblock == 0 && superblock->reshape_backup != 0)
+            raid_reshape_restore(superblock);
+
         // Commit under lock, handle possible race with another loader
         acquire(&raid_device.metadata_lock);
         if (raid_device.superblock == 0 || raid_device.is_init == -1)
@@ -68,12 +78,15 @@ int load_metadata(struct RAIDSuperblock **metadata)
             raid_device.is_init = 1;
             raid_device.disk_status[0] = raid_device.superblock->disk_status;
             release(&raid_device.metadata_lock);
+            if (superblock->reshape_old_disks != 0)
+                printf("RAID reshape to %d data disks interrupted, call expand_raid to resume\n", superblock->num_of_disks);
         }
         else
         {
             release(&raid_device.metadata_lock);
             kfree(data);
         }
+        releasesleep(&raid_device.gate_lock);
     }
 
     if (raid_device.superblock == 0 || is_raid_uninitialized(raid_device.superblock))
@@ -83,6 +96,101 @@ int load_metadata(struct RAIDSuperblock **metadata)
     return 0;
 }
 
+// Make every finished write to the RAID disks and the journal disk durable
+void raid_flush_disks()
+{
+    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_DISK_END; i++)
+        virtio_disk_flush(i);
+}
+
+// Write the cached superblock to every RAID disk, keeping each disk's own
+// health. Superblock updates commit data moves, so they are flush barriers.
+void persist_superblock(struct RAIDSuperblock *currMetadata)
+{
+    raid_flush_disks(); // Moved data before the superblock that points at it
+    uchar *data = kalloc();
+    struct RAIDSuperblock *superblock = (struct RAIDSuperblock *)data;
+    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++)
+    {
+        memset(data, 0, BSIZE);
+        memmove(superblock, currMetadata, sizeof(struct RAIDSuperblock));
+        superblock->disk_status = get_disk_health(i);
+        write_block(i, 0, data);
+    }
+    kfree(data);
+    raid_flush_disks();
+}
+
+// Start of an array I/O. While expand_raid or a spare rebuild moves data,
+// I/O runs under gate_lock so it never sees a block that is half moved.
+// Returns 1 if gate_lock was taken.
+int raid_io_begin()
+{
+    acquire(&raid_device.metadata_lock);
+    if (raid_device.exclusive)
+    {
+        release(&raid_device.metadata_lock);
+        acquiresleep(&raid_device.gate_lock);
+        return 1;
+    }
+    raid_device.io_active++;
+    release(&raid_device.metadata_lock);
+    return 0;
+}
+
+// raid_io_begin for background I/O that is better dropped than delayed
+// behind a data move. Returns -1 instead of waiting for gate_lock.
+int raid_io_try_begin()
+{
+    acquire(&raid_device.metadata_lock);
+    if (raid_device.exclusive)
+    {
+        release(&raid_device.metadata_lock);
+        return -1;
+    }
+    raid_device.io_active++;
+    release(&raid_device.metadata_lock);
+    return 0;
+}
+
+void raid_io_end(int locked)
+{
+    if (locked)
+    {
+        releasesleep(&raid_device.gate_lock);
+        return;
+    }
+    acquire(&raid_device.metadata_lock);
+    raid_device.io_active--;
+    if (raid_device.io_active == 0)
+        wakeup(&raid_device.io_active); // raid_gate_close may wait for the array to drain
+    release(&raid_device.metadata_lock);
+}
+
+// Send all new I/O through gate_lock and wait for the rest to finish.
+// Returns -1 if someone else already moves data.
+int raid_gate_close()
+{
+    acquire(&raid_device.metadata_lock);
+    if (raid_device.exclusive)
+    {
+        release(&raid_device.metadata_lock);
+        return -1;
+    }
+    raid_device.exclusive = 1;
+    while (raid_device.io_active > 0)
+        sleep(&raid_device.io_active, &raid_device.metadata_lock);
+    release(&raid_device.metadata_lock);
+    return 0;
+}
+
+void raid_gate_open()
+{
+    acquire(&raid_device.metadata_lock);
+    raid_device.exclusive = 0;
+    release(&raid_device.metadata_lock);
+}
+
 void init_raid_device()
 {
     for (int i = VIRTIO_RAID_DISK_START; i < VIRTIO_RAID_DISK_END; i++)
@@ -90,6 +198,16 @@ void init_raid_device()
         initsleeplock(&raid_device.disks[i].disk_lock, "raid_disk");
     }
     initlock(&raid_device.metadata_lock, "raid_metadata");
+    initsleeplock(&raid_device.gate_lock, "raid_gate");
+    raid_device.exclusive = 0;
+    raid_device.io_active = 0;
+    raid_device.mounted = 0;
+    raid_device.failover_pending = 0;
+    init_work(&raid_device.failover_work, raid_failover_work);
+    init_work(&raid_device.reshape_work, raid_reshape_work);
+    init_raid_journal();
+    init_raid_readahead();
+    init_raid_latency();
 
     if (VIRTIO_RAID_DISK_END < 2)
     {
@@ -108,51 +226,61 @@ void init_raid_device()
     }
 }
 
-int formatOneDisk(uint64 disk_num, uchar *nullData)
+int formatOneDisk(uint64 disk_num)
 {
     if (disk_num < VIRTIO_RAID_DISK_START || disk_num > VIRTIO_RAID_DISK_END)
     {
         return -1;
     }
-    for (int j = 0; j < DISK_SIZE * 1024 * 1024 / BSIZE; j++)
-        write_block(disk_num, j, nullData);
+    zero_blocks(disk_num, 0, DISK_SIZE * 1024 * 1024 / BSIZE);
     return 0;
 }
 
 int formatDisks()
 {
-    uchar data[BSIZE];
-    memset(data, 0, BSIZE);
     for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++)
     {
-        if (formatOneDisk(i, data) == -1)
+        if (formatOneDisk(i) == -1)
             return -1;
     }
     return 0;
 }
 
+// Layouts address member slots 1..N. A slot whose disk failed and was
+// rebuilt onto the spare is served by the spare from then on.
+uint64 slot_disk(struct RAIDSuperblock *currMetadata, uint64 slot)
+{
+    if (slot <= VIRTIO_RAID_DISK_END && currMetadata->disk_map[slot] != 0)
+        return currMetadata->disk_map[slot];
+    return slot;
+}
+
+// Member slot served by disk_num, 0 if the disk is not part of the array
+uint64 disk_slot(struct RAIDSuperblock *currMetadata, uint64 disk_num)
+{
+    for (uint64 slot = 1; slot <= member_disks(currMetadata); slot++)
+    {
+        if (slot_disk(currMetadata, slot) == disk_num)
+            return slot;
+    }
+    return 0;
+}
+
 int handle_rw_raid01(struct RAIDSuperblock *currMetadata, uint64 disk_num, uint64 blkc_num, uchar *p_buff, int isRead)
 {
     if (isRead)
     {
-        enum DISK_HEALTH disk_health = get_disk_health(disk_num);
-        if (disk_health == HEALTHY)
+        // Hedged to the mirror if the primary stalls
+        uint64 disks[2] = {disk_num, slot_disk(currMetadata, disk_slot(currMetadata, disk_num) + currMetadata->num_of_disks)};
+        uint64 blkcs[2] = {blkc_num, blkc_num};
+        if (raid_mirror_read(disks, blkcs, p_buff) == -1)
         {
-            read_block(disk_num, blkc_num, p_buff);
-        }
-        else
-        {
-            disk_health = get_disk_health(disk_num + currMetadata->num_of_disks);
-            if (disk_health != HEALTHY)
-            {
-                return -1; // We can't read from the mirror disk, LOST DATA!
-            }
-            read_block(disk_num + currMetadata->num_of_disks, blkc_num, p_buff);
+            return -1; // We can't read from the mirror disk, LOST DATA!
         }
     }
     else
     {
-        uint64 mirror = disk_num + currMetadata->num_of_disks;
+        uint64 mirror = slot_disk(currMetadata, disk_slot(currMetadata, disk_num) + currMetadata->num_of_disks);
         uint64 first = disk_num < mirror ? disk_num : mirror;
         uint64 second = disk_num < mirror ? mirror : disk_num;
         acquiresleep(&raid_device.disks[first].disk_lock);
@@ -161,7 +289,7 @@ int handle_rw_raid01(struct RAIDSuperblock *currMetadata, uint64 disk_num, uint6
         enum DISK_HEALTH disk_health = get_disk_health(disk_num);
         if (disk_health == HEALTHY)
         {
-            write_block(disk_num, blkc_num, p_buff);
+            raid_timed_write(disk_num, blkc_num, p_buff);
         }
         else
         {
@@ -173,7 +301,7 @@ int handle_rw_raid01(struct RAIDSuperblock *currMetadata, uint64 disk_num, uint6
                 return -1; // We can't write into the mirror disk, LOST DATA!
             }
         }
-        write_block(mirror, blkc_num, p_buff); // Write into mirror disk
+        raid_timed_write(mirror, blkc_num, p_buff); // Write into mirror disk
 
         releasesleep(&raid_device.disks[second].disk_lock);
         releasesleep(&raid_device.disks[first].disk_lock);
@@ -181,19 +309,147 @@ int handle_rw_raid01(struct RAIDSuperblock *currMetadata, uint64 disk_num, uint6
     return 0;
 }
 
-// For given parity disk and block, calculate and write new parrity block onto the disk
-void write_parrity_block(uint64 parity_disk, uint64 parity_block, uchar *oldData, uchar *newData)
+// Both copies of a RAID10 block. num_of_disks counts every member here.
+// Near: the two copies sit next to each other in the stripe.
+// Far: the first copies form a RAID0 over the inner half of every disk,
+// the second copies the same RAID0 in the outer half, shifted by one disk.
+void raid10_map_copies(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 *disks, uint64 *blkcs)
+{
+    uint64 blockPerDisk = (DISK_SIZE * 1024 * 1024) / BSIZE;
+    uint64 members = currMetadata->num_of_disks;
+    if (currMetadata->raid_level == RAID10_NEAR)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            uint64 pos = block_num * 2 + k;
+            disks[k] = (pos % members) + 1;
+            blkcs[k] = (pos / members) + 1;
+        }
+    }
+    else
+    {
+        uint64 half = (blockPerDisk - 1) / 2;
+        disks[0] = (block_num % members) + 1;
+        blkcs[0] = (block_num / members) + 1;
+        disks[1] = ((block_num + 1) % members) + 1;
+        blkcs[1] = half + (block_num / members) + 1;
+    }
+}
+
+int handle_rw_raid10(struct RAIDSuperblock *currMetadata, uint64 block_num, uchar *p_buff, int isRead)
+{
+    uint64 disks[2], blkcs[2];
+    raid10_map_copies(currMetadata, block_num, disks, blkcs);
+    disks[0] = slot_disk(currMetadata, disks[0]);
+    disks[1] = slot_disk(currMetadata, disks[1]);
+    if (isRead)
+    {
+        // First copy of the far layout is striped like RAID0, prefer it
+        if (raid_mirror_read(disks, blkcs, p_buff) == -1)
+            return -1; // Both copies are gone, LOST DATA!
+        return 0;
+    }
+
+    int first = disks[0] < disks[1] ? 0 : 1;
+    acquiresleep(&raid_device.disks[disks[first]].disk_lock);
+    acquiresleep(&raid_device.disks[disks[1 - first]].disk_lock);
+    int written = 0;
+    for (int k = 0; k < 2; k++)
+    {
+        if (get_disk_health(disks[k]) == HEALTHY)
+        {
+            raid_timed_write(disks[k], blkcs[k], p_buff);
+            written++;
+        }
+    }
+    releasesleep(&raid_device.disks[disks[1 - first]].disk_lock);
+    releasesleep(&raid_device.disks[disks[first]].disk_lock);
+    return written > 0 ? 0 : -1;
+}
+
+// Read a RAID4/5 member block, preferring a newer copy still waiting in the journal
+void read_member_block(uint64 disk_num, uint64 blkc_num, uchar *data)
+{
+    if (raid_journal_lookup(disk_num, blkc_num, data) == 0)
+        return;
+    read_block(disk_num, blkc_num, data);
+}
+
+// For given parity disk and block, calculate new parrity block and write it
+// together with the new data, through the stripe journal when there is one
+void write_parrity_block(uint64 data_disk, uint64 parity_disk, uint64 blkc_num, uchar *oldData, uchar *newData)
 {
     uchar parityData[BSIZE];
-    read_block(parity_disk, parity_block, parityData);
+    read_member_block(parity_disk, blkc_num, parityData);
 
-    // Calculate new parity data
-    uchar *newParrityData = kalloc();
+    // Calculate new parity data, in place so there is no page to allocate
     for (int i = 0; i < BSIZE; i++)
-        newParrityData[i] = (newData[i] ^ oldData[i]) ^ parityData[i];
+        parityData[i] ^= newData[i] ^ oldData[i];
 
-    write_block(parity_disk, parity_block, newParrityData); // Write new data to parity block
-    kfree(newParrityData);
+    if (raid_journal_append(data_disk, parity_disk, blkc_num, newData, parityData) == -1)
+    {
+        write_block(parity_disk, blkc_num, parityData); // Write new data to parity block
+        write_block(data_disk, blkc_num, newData);
+    }
+}
+
+// Map a logical block onto the disk and block that hold it, for an array
+// with the given number of data disks. For mirrored levels this is the
+// primary copy, for RAID4/5 parity_disk is set too. Layouts work on
+// member slots, the result is the disk currently serving the slot.
+void map_block_layout(struct RAIDSuperblock *currMetadata, uint64 num_of_disks, uint64 block_num, uint64 *disk_num, uint64 *blkc_num, uint64 *parity_disk)
+{
+    uint64 blockPerDisk = (DISK_SIZE * 1024 * 1024) / BSIZE;
+    *parity_disk = 0;
+    switch (currMetadata->raid_level)
+    {
+    case RAID0:
+    case RAID4:
+        *disk_num = (block_num % num_of_disks) + 1;
+        *blkc_num = (block_num / num_of_disks) + 1;
+        if (currMetadata->raid_level == RAID4)
+            *parity_disk = currMetadata->parrity_disk;
+        break;
+    case RAID1:
+        *disk_num = (block_num / (blockPerDisk - 1)) + 1;
+        *blkc_num = (block_num % (blockPerDisk - 1)) + 1;
+        break;
+    case RAID0_1:
+        *disk_num = (block_num % num_of_disks) + 1;
+        *blkc_num = ((block_num + num_of_disks) / num_of_disks);
+        break;
+    case RAID5:
+        // NOTE: Number of disks is NUMBER OF ALL DISKS - 1 (parity disk) for RAID4 and for RADI5
+        uint64 stripe_index = block_num / (num_of_disks) + 1;
+        uint64 stripe_offset = block_num % (num_of_disks) + 1;
+        uint64 parrity_index = (num_of_disks + 1) - ((stripe_index - 1) % (num_of_disks + 1));
+        *disk_num = parrity_index + stripe_offset;
+        if (*disk_num > num_of_disks + 1)
+            *disk_num = *disk_num % (num_of_disks + 1);
+        *blkc_num = stripe_index;
+        *parity_disk = parrity_index;
+        break;
+    case RAID10_NEAR:
+    case RAID10_FAR:
+        uint64 disks[2], blkcs[2];
+        raid10_map_copies(currMetadata, block_num, disks, blkcs);
+        *disk_num = disks[0];
+        *blkc_num = blkcs[0];
+        break;
+    }
+    *disk_num = slot_disk(currMetadata, *disk_num);
+    if (*parity_disk != 0)
+        *parity_disk = slot_disk(currMetadata, *parity_disk);
+}
+
+// Map a logical block onto the disk and block that hold it. While a
+// reshape is running, blocks above the watermark are still in the old layout.
+void raid_map_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 *disk_num, uint64 *blkc_num, uint64 *parity_disk)
+{
+    uint64 num_of_disks = currMetadata->num_of_disks;
+    if (currMetadata->reshape_old_disks != 0 && block_num >= currMetadata->reshape_pos)
+        num_of_disks = currMetadata->reshape_old_disks;
+    map_block_layout(currMetadata, num_of_disks, block_num, disk_num, blkc_num, parity_disk);
 }
 
 // Handle read/write for all RAID levels
@@ -202,14 +458,13 @@ int rw_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 p_buf
     enum RAID_TYPE raid_type = currMetadata->raid_level;
     uint64 disk_num;
     uint64 blkc_num;
-    uint64 blockPerDisk = (DISK_SIZE * 1024 * 1024) / BSIZE;
+    uint64 parity_disk;
     enum DISK_HEALTH disk_health;
+
+    raid_map_block(currMetadata, block_num, &disk_num, &blkc_num, &parity_disk);
     switch (raid_type)
     {
     case RAID0:
-        disk_num = (block_num % currMetadata->num_of_disks) + 1;
-        blkc_num = (block_num / currMetadata->num_of_disks) + 1;
-
         disk_health = get_disk_health(disk_num);
         if (disk_health != HEALTHY)
             return -1; // LOST DATA!
@@ -224,71 +479,19 @@ int rw_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 p_buf
         }
         break;
     case RAID1:
-        disk_num = (block_num / (blockPerDisk - 1)) + 1;
-        blkc_num = (block_num % (blockPerDisk - 1)) + 1;
-        if (handle_rw_raid01(currMetadata, disk_num, blkc_num, (uchar *)p_buff, isRead) == -1)
-        {
-            return -1; // LOST DATA!
-        }
-        break;
     case RAID0_1:
-        disk_num = (block_num % currMetadata->num_of_disks) + 1;
-        blkc_num = ((block_num + currMetadata->num_of_disks) / currMetadata->num_of_disks);
         if (handle_rw_raid01(currMetadata, disk_num, blkc_num, (uchar *)p_buff, isRead) == -1)
         {
             return -1; // LOST DATA!
         }
         break;
-    case RAID4:
-        disk_num = (block_num % currMetadata->num_of_disks) + 1;
-        blkc_num = (block_num / currMetadata->num_of_disks) + 1;
-
-        // Check if the disk is healthy
-        disk_health = get_disk_health(disk_num);
-        if (disk_health != HEALTHY)
+    case RAID10_NEAR:
+    case RAID10_FAR:
+        if (handle_rw_raid10(currMetadata, block_num, (uchar *)p_buff, isRead) == -1)
             return -1; // LOST DATA!
-
-        if (isRead)
-        {
-            read_block(disk_num, blkc_num, (uchar *)p_buff);
-        }
-        else
-        {
-            // Lock both data disk and fixed parity disk in order
-            uint64 parity_disk = currMetadata->parrity_disk;
-            uint64 first = parity_disk < disk_num ? parity_disk : disk_num;
-            uint64 second = parity_disk < disk_num ? disk_num : parity_disk;
-            acquiresleep(&raid_device.disks[first].disk_lock);
-            acquiresleep(&raid_device.disks[second].disk_lock);
-
-            uchar oldData[BSIZE];
-            read_block(disk_num, blkc_num, oldData);
-
-            // It's the same data, no need to write
-            if (memcmp(oldData, (uchar *)p_buff, BSIZE) == 0)
-            {
-                releasesleep(&raid_device.disks[second].disk_lock);
-                releasesleep(&raid_device.disks[first].disk_lock);
-                return 0;
-            }
-
-            write_parrity_block(parity_disk, blkc_num, oldData, (uchar *)p_buff);
-            write_block(disk_num, blkc_num, (uchar *)p_buff);
-
-            releasesleep(&raid_device.disks[second].disk_lock);
-            releasesleep(&raid_device.disks[first].disk_lock);
-        }
         break;
+    case RAID4:
     case RAID5:
-        // NOTE: Number of disks is NUMBER OF ALL DISKS - 1 (parity disk) for RAID4 and for RADI5
-        uint64 stripe_index = block_num / (currMetadata->num_of_disks) + 1;
-        uint64 stripe_offset = block_num % (currMetadata->num_of_disks) + 1;
-        uint64 parrity_index = (currMetadata->num_of_disks + 1) - ((stripe_index - 1) % (currMetadata->num_of_disks + 1));
-        disk_num = parrity_index + stripe_offset;
-        if (disk_num > currMetadata->num_of_disks + 1)
-            disk_num = disk_num % (currMetadata->num_of_disks + 1);
-        blkc_num = stripe_index;
-
         // Check if the disk is healthy
         disk_health = get_disk_health(disk_num);
         if (disk_health != HEALTHY)
@@ -296,19 +499,18 @@ int rw_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 p_buf
 
         if (isRead)
         {
-            read_block(disk_num, blkc_num, (uchar *)p_buff);
+            read_member_block(disk_num, blkc_num, (uchar *)p_buff);
         }
         else
         {
-            // Lock both data disk and rotating parity disk in order
-            uint64 parity_disk = parrity_index;
+            // Lock both data disk and parity disk (fixed for RAID4, rotating for RAID5) in order
             uint64 first = parity_disk < disk_num ? parity_disk : disk_num;
             uint64 second = parity_disk < disk_num ? disk_num : parity_disk;
             acquiresleep(&raid_device.disks[first].disk_lock);
             acquiresleep(&raid_device.disks[second].disk_lock);
 
             uchar oldData[BSIZE];
-            read_block(disk_num, blkc_num, oldData);
+            read_member_block(disk_num, blkc_num, oldData);
 
             // It's the same data, no need to write
             if (memcmp(oldData, (uchar *)p_buff, BSIZE) == 0)
@@ -318,8 +520,7 @@ int rw_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 p_buf
                 return 0;
             }
 
-            write_parrity_block(parity_disk, blkc_num, oldData, (uchar *)p_buff);
-            write_block(disk_num, blkc_num, (uchar *)p_buff);
+            write_parrity_block(disk_num, parity_disk, blkc_num, oldData, (uchar *)p_buff);
 
             releasesleep(&raid_device.disks[second].disk_lock);
             releasesleep(&raid_device.disks[first].disk_lock);
@@ -366,18 +567,46 @@ void mirrorRecovery(uint64 disk1, uint64 disk2)
     printf("Recovery finished\n");
 }
 
-void raid4_and_5_recovery(uint64 recoverDisk)
+// Blocks per disk that hold array data; a journal at the tail of a member is excluded
+uint64 data_blocks_per_disk(struct RAIDSuperblock *currMetadata)
 {
     uint64 blockPerDisk = (DISK_SIZE * 1024 * 1024) / BSIZE;
+    if (currMetadata->journal_disk >= VIRTIO_RAID_DISK_START && currMetadata->journal_disk <= VIRTIO_RAID_DISK_END)
+        return blockPerDisk - RAID_JOURNAL_BLOCKS;
+    return blockPerDisk;
+}
+
+// Number of physical disks that belong to the array, they are disks 1..N
+uint64 member_disks(struct RAIDSuperblock *currMetadata)
+{
+    switch (currMetadata->raid_level)
+    {
+    case RAID1:
+    case RAID0_1:
+        return currMetadata->num_of_disks * 2;
+    case RAID4:
+    case RAID5:
+        return currMetadata->num_of_disks + 1;
+    default:
+        return currMetadata->num_of_disks;
+    }
+}
+
+// Rebuild member slot recoverSlot onto disk target
+void raid4_and_5_recovery(struct RAIDSuperblock *currMetadata, uint64 recoverSlot, uint64 target)
+{
+    uint64 blockPerDisk = data_blocks_per_disk(currMetadata);
+    uint64 members = member_disks(currMetadata);
 
     for (uint64 i = 1; i < blockPerDisk; i++)
     {
         uchar recoveryBlock[BSIZE];
-        uint64 dataDisk = (recoverDisk + 1) % (VIRTIO_RAID_DISK_END + 1);
-        read_block(dataDisk, i, recoveryBlock);
-        for (uint64 j = 1; j < VIRTIO_RAID_DISK_END - 1; j++)
+        // XOR of all other members (data and parity) gives the lost block
+        uint64 dataSlot = (recoverSlot % members) + 1;
+        read_block(slot_disk(currMetadata, dataSlot), i, recoveryBlock);
+        for (uint64 j = 1; j < members - 1; j++)
         {
-            uint64 currDisk = (dataDisk + j) % (VIRTIO_RAID_DISK_END + 1);
+            uint64 currDisk = slot_disk(currMetadata, ((dataSlot + j - 1) % members) + 1);
             uchar *nextBlock = kalloc();
             read_block(currDisk, i, nextBlock);
             for (uint64 k = 0; k < BSIZE; k++)
@@ -386,12 +615,38 @@ void raid4_and_5_recovery(uint64 recoverDisk)
             }
             kfree(nextBlock);
         }
-        write_block(recoverDisk, i, recoveryBlock);
+        write_block(target, i, recoveryBlock);
+    }
+}
+
+// Copy every block that has a copy in recoverSlot from its other copy to target
+int raid10_recovery(struct RAIDSuperblock *currMetadata, uint64 recoverSlot, uint64 target)
+{
+    uchar *data = kalloc();
+    uint64 disks[2], blkcs[2];
+    for (uint64 i = 0; i <= currMetadata->max_blknum; i++)
+    {
+        raid10_map_copies(currMetadata, i, disks, blkcs);
+        for (int k = 0; k < 2; k++)
+        {
+            if (disks[k] != recoverSlot)
+                continue;
+            uint64 source = slot_disk(currMetadata, disks[1 - k]);
+            if (get_disk_health(source) != HEALTHY)
+            {
+                kfree(data);
+                return -1; // LOST DATA!
+            }
+            read_block(source, blkcs[1 - k], data);
+            write_block(target, blkcs[k], data);
+        }
     }
+    kfree(data);
+    return 0;
 }
 
-// Recover data based on the RAID level and given failed disk number
-int handle_recovery(struct RAIDSuperblock *currMetadata, uint64 failed_count, uint64 disk_num)
+// Recover data of the given member slot onto disk target, based on the RAID level
+int handle_recovery(struct RAIDSuperblock *currMetadata, uint64 failed_count, uint64 slot, uint64 target)
 {
     enum RAID_TYPE raid_type = currMetadata->raid_level;
 
@@ -401,80 +656,131 @@ int handle_recovery(struct RAIDSuperblock *currMetadata, uint64 failed_count, ui
         return -1;
     case RAID1:
     case RAID0_1:
-        uint64 recoverDisk = (disk_num >= currMetadata->num_of_disks) ? disk_num - currMetadata->num_of_disks : disk_num + currMetadata->num_of_disks;
+        uint64 recoverDisk = slot_disk(currMetadata, (slot > currMetadata->num_of_disks) ? slot - currMetadata->num_of_disks : slot + currMetadata->num_of_disks);
         if (get_disk_health(recoverDisk) != HEALTHY)
             return -1; // LOST DATA!
-        mirrorRecovery(recoverDisk, disk_num);
+        mirrorRecovery(recoverDisk, target);
         break;
     case RAID4:
-        if (failed_count > 1 || currMetadata->parrity_disk == disk_num)
+        if (failed_count > 1 || currMetadata->parrity_disk == slot)
             return -1;
-        raid4_and_5_recovery(disk_num);
+        raid4_and_5_recovery(currMetadata, slot, target);
         break;
     case RAID5:
         if (failed_count > 1)
             return -1;
-        raid4_and_5_recovery(disk_num);
+        raid4_and_5_recovery(currMetadata, slot, target);
         break;
+    case RAID10_NEAR:
+    case RAID10_FAR:
+        return raid10_recovery(currMetadata, slot, target);
     }
     return 0;
 }
 
+// Unhealthy member slots of the array
+uint64 failed_members(struct RAIDSuperblock *currMetadata)
+{
+    uint64 fail_count = 0;
+    for (uint64 slot = 1; slot <= member_disks(currMetadata); slot++)
+    {
+        if (get_disk_health(slot_disk(currMetadata, slot)) == UNHEALTY)
+            fail_count++;
+    }
+    return fail_count;
+}
+
 int raid_system_init(enum RAID_TYPE raid_type)
 {
+    if (raid_device.mounted)
+        return -1; // The root file system lives on the array
+    raid_wait_background();
     // I could add here formatDisks() to format all disks before init
     // TODO: decide if to format disks before init
 
     struct RAIDSuperblock *metadata = (struct RAIDSuperblock *)kalloc();
-    metadata->num_of_disks = VIRTIO_RAID_DISK_END;
+    metadata->num_of_disks = VIRTIO_RAID_MEMBERS;
     metadata->raid_level = raid_type;
     metadata->blk_size = BSIZE;
     metadata->disk_status = HEALTHY;
     metadata->parrity_disk = -1;
     metadata->swap_disk = -1;
+    metadata->journal_disk = -1;
+    metadata->journal_start = 0;
+    metadata->reshape_old_disks = 0;
+    metadata->reshape_pos = 0;
+    metadata->reshape_backup = 0;
+    memset(metadata->disk_map, 0, sizeof(metadata->disk_map));
     uint64 blockPerDisk = (DISK_SIZE * 1024 * 1024) / BSIZE;
     switch (raid_type)
     {
     case RAID0:
-        metadata->max_blknum = (blockPerDisk * VIRTIO_RAID_DISK_END) - (VIRTIO_RAID_DISK_END);
+        metadata->max_blknum = (blockPerDisk * VIRTIO_RAID_MEMBERS) - (VIRTIO_RAID_MEMBERS);
         break;
     case RAID1:
     case RAID0_1:
         // If there is no enough disks for RAID1 or RAID0_1
-        if (VIRTIO_RAID_DISK_END == 1)
+        if (VIRTIO_RAID_MEMBERS == 1)
         {
             kfree(metadata);
             return -2;
         }
-        metadata->num_of_disks = (VIRTIO_RAID_DISK_END) / 2;
+        metadata->num_of_disks = (VIRTIO_RAID_MEMBERS) / 2;
         metadata->max_blknum = (blockPerDisk * metadata->num_of_disks) - metadata->num_of_disks;
 
         // Set hotswap disk if one disk fail
-        if (((VIRTIO_RAID_DISK_END) & 1) == 1)
-            metadata->swap_disk = VIRTIO_RAID_DISK_END;
+        if (((VIRTIO_RAID_MEMBERS) & 1) == 1)
+            metadata->swap_disk = VIRTIO_RAID_MEMBERS;
         break;
 
     case RAID4:
-        metadata->parrity_disk = VIRTIO_RAID_DISK_END;
+        metadata->parrity_disk = VIRTIO_RAID_MEMBERS;
     case RAID5:
-        metadata->num_of_disks = VIRTIO_RAID_DISK_END - 1;
-        if (VIRTIO_RAID_DISK_END == 2)
+        metadata->num_of_disks = VIRTIO_RAID_MEMBERS - 1;
+        if (VIRTIO_RAID_MEMBERS == 2)
+        {
+            kfree(metadata);
+            return -2;
+        }
+        if (VIRTIO_JOURNAL_DISK > 0)
+        {
+            // Member disk: journal takes the tail of it, and of every stripe.
+            // Extra disk: the journal starts right after block 0.
+            metadata->journal_disk = VIRTIO_JOURNAL_DISK;
+            metadata->journal_start = VIRTIO_JOURNAL_DISK <= VIRTIO_RAID_DISK_END ? blockPerDisk - RAID_JOURNAL_BLOCKS : 1;
+        }
+        blockPerDisk = data_blocks_per_disk(metadata);
+        metadata->max_blknum = (blockPerDisk * (VIRTIO_RAID_MEMBERS - 1)) - VIRTIO_RAID_MEMBERS;
+        break;
+    case RAID10_NEAR:
+    case RAID10_FAR:
+        // Every member holds data, any number of disks from two up works
+        if (VIRTIO_RAID_MEMBERS == 1)
         {
             kfree(metadata);
             return -2;
         }
-        metadata->max_blknum = (blockPerDisk * (VIRTIO_RAID_DISK_END - 1)) - VIRTIO_RAID_DISK_END;
+        if (raid_type == RAID10_NEAR)
+            metadata->max_blknum = (VIRTIO_RAID_MEMBERS * (blockPerDisk - 1)) / 2 - 1;
+        else
+            metadata->max_blknum = VIRTIO_RAID_MEMBERS * ((blockPerDisk - 1) / 2) - 1;
         break;
     default:
         kfree(metadata);
         printf("Invalid RAID type\n");
         return -1;
     }
+    // Disks left over by MEMBERS give redundant levels a hot spare
+    if (raid_type != RAID0 && metadata->swap_disk == -1 && VIRTIO_RAID_MEMBERS < VIRTIO_RAID_DISK_END &&
+        metadata->journal_disk != VIRTIO_RAID_DISK_END)
+        metadata->swap_disk = VIRTIO_RAID_DISK_END;
     for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++)
     {
         // Write into the first block of disk i
         write_block(i, 0, (uchar *)metadata);
     }
+    raid_journal_format(metadata);
+    raid_readahead_invalidate_all();
     raid_device.superblock = metadata;
     raid_device.is_init = 1; // We initailized the raid device
     return 0;
@@ -498,7 +804,16 @@ int raid_read_block(uint64 block_num, uint64 buffAddr)
     struct proc *p = myproc();
     uint64 p_buff = walkaddr(p->pagetable, buffAddr) | (buffAddr & OFFSET_MASK);
 
-    return rw_block(currMetadata, block_num, p_buff, 1);
+    int locked = raid_io_begin();
+
+    // Queue prefetches first so they overlap with this read
+    raid_readahead_advance(currMetadata, block_num);
+    int err = 0;
+    if (raid_readahead_read(block_num, (uchar *)p_buff) != 0)
+        err = rw_block(currMetadata, block_num, p_buff, 1);
+
+    raid_io_end(locked);
+    return err;
 }
 
 int raid_write_block(uint64 block_num, uint64 buffAddr)
@@ -519,7 +834,125 @@ int raid_write_block(uint64 block_num, uint64 buffAddr)
     struct proc *p = myproc();
     uint64 p_buff = walkaddr(p->pagetable, buffAddr) | (buffAddr & OFFSET_MASK);
 
-    return rw_block(currMetadata, block_num, p_buff, 0);
+    int locked = raid_io_begin();
+    int err = rw_block(currMetadata, block_num, p_buff, 0);
+    raid_readahead_invalidate(block_num);
+    raid_io_end(locked);
+    return err;
+}
+
+// Member blocks waiting to be zeroed, one run of consecutive blocks per disk
+struct RAIDTrimRun
+{
+    uint64 start;
+    uint64 len;
+};
+
+void trim_run_flush(struct RAIDTrimRun *runs, uint64 disk_num)
+{
+    // A failed member is rebuilt from the others, it can be skipped
+    if (runs[disk_num].len > 0 && get_disk_health(disk_num) == HEALTHY)
+        zero_blocks(disk_num, runs[disk_num].start, runs[disk_num].len);
+    runs[disk_num].len = 0;
+}
+
+void trim_member_block(struct RAIDTrimRun *runs, uint64 disk_num, uint64 blkc_num)
+{
+    struct RAIDTrimRun *run = &runs[disk_num];
+    if (run->len > 0 && run->start + run->len == blkc_num)
+    {
+        run->len++;
+        return;
+    }
+    trim_run_flush(runs, disk_num);
+    run->start = blkc_num;
+    run->len = 1;
+}
+
+// Zero count logical blocks from start_blk and let the member disks
+// deallocate them. Every copy is zeroed, and a RAID4/5 stripe that is
+// trimmed whole gets zero parity; a partly trimmed stripe is written
+// with zeroes like any other block, which keeps its parity right.
+int raid_trim(uint64 start_blk, uint64 count)
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1)
+    {
+        return -2; // RAID is not initialized
+    }
+    if (start_blk > currMetadata->max_blknum || count > currMetadata->max_blknum - start_blk + 1)
+    {
+        return -1; // Range is invalid
+    }
+    if (currMetadata->reshape_old_disks != 0)
+    {
+        return -1; // Blocks are moving between disks, finish expand_raid first
+    }
+    if (raid_gate_close() == -1)
+        return -1; // Someone else is moving the data
+
+    acquiresleep(&raid_device.gate_lock);
+    // Members are zeroed directly, so journaled writes must be home first
+    raid_journal_checkpoint();
+
+    struct RAIDTrimRun *runs = kalloc();
+    memset(runs, 0, sizeof(struct RAIDTrimRun) * (VIRTIO_RAID_DISK_END + 1));
+    uchar *zero = kalloc();
+    memset(zero, 0, BSIZE);
+
+    int err = 0;
+    uint64 end = start_blk + count;
+    uint64 disks[2], blkcs[2], parity_disk;
+    for (uint64 b = start_blk; b < end; b++)
+    {
+        switch (currMetadata->raid_level)
+        {
+        case RAID0:
+            raid_map_block(currMetadata, b, &disks[0], &blkcs[0], &parity_disk);
+            trim_member_block(runs, disks[0], blkcs[0]);
+            break;
+        case RAID1:
+        case RAID0_1:
+            raid_map_block(currMetadata, b, &disks[0], &blkcs[0], &parity_disk);
+            trim_member_block(runs, disks[0], blkcs[0]);
+            trim_member_block(runs, slot_disk(currMetadata, disk_slot(currMetadata, disks[0]) + currMetadata->num_of_disks), blkcs[0]);
+            break;
+        case RAID10_NEAR:
+        case RAID10_FAR:
+            raid10_map_copies(currMetadata, b, disks, blkcs);
+            trim_member_block(runs, slot_disk(currMetadata, disks[0]), blkcs[0]);
+            trim_member_block(runs, slot_disk(currMetadata, disks[1]), blkcs[1]);
+            break;
+        case RAID4:
+        case RAID5:
+            uint64 stripe = currMetadata->num_of_disks;
+            if (b % stripe == 0 && b + stripe <= end)
+            {
+                // Zero data has zero parity
+                for (uint64 c = 0; c < stripe; c++)
+                {
+                    raid_map_block(currMetadata, b + c, &disks[0], &blkcs[0], &parity_disk);
+                    trim_member_block(runs, disks[0], blkcs[0]);
+                }
+                trim_member_block(runs, parity_disk, blkcs[0]);
+                b += stripe - 1;
+            }
+            else if (rw_block(currMetadata, b, (uint64)zero, 0) == -1)
+            {
+                err = -1; // LOST DATA!
+            }
+            break;
+        }
+    }
+    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++)
+        trim_run_flush(runs, i);
+
+    kfree(zero);
+    kfree(runs);
+    raid_readahead_invalidate_all();
+    releasesleep(&raid_device.gate_lock);
+    raid_gate_open();
+    return err;
 }
 
 int raid_fail_disk(uint64 disk_num)
@@ -536,9 +969,81 @@ int raid_fail_disk(uint64 disk_num)
     currMetadata->disk_status = UNHEALTY;                          // Update the raid status in the disk
     raid_device.disk_status[disk_num] = currMetadata->disk_status; // Update the raid device status in cache
 
+    // The rebuild runs in a worker thread, the caller doesn't wait for it
+    acquire(&raid_device.metadata_lock);
+    raid_device.failover_pending |= 1ull << disk_num;
+    release(&raid_device.metadata_lock);
+    queue_work_long(&raid_device.failover_work);
     return 0;
 }
 
+// Fail over every disk raid_fail_disk queued
+void raid_failover_work(struct work *w)
+{
+    for (;;)
+    {
+        uint64 disk_num = 0;
+        acquire(&raid_device.metadata_lock);
+        for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END && disk_num == 0; i++)
+        {
+            if (raid_device.failover_pending & (1ull << i))
+                disk_num = i;
+        }
+        raid_device.failover_pending &= ~(1ull << disk_num);
+        release(&raid_device.metadata_lock);
+        if (disk_num == 0)
+            return;
+        raid_failover(disk_num);
+    }
+}
+
+// Wait for rebuilds and reshapes running in the background
+void raid_wait_background()
+{
+    flush_work(&raid_device.failover_work);
+    flush_work(&raid_device.reshape_work);
+}
+
+// Rebuild the slot of a failed member onto the hot spare and let the
+// spare serve that slot from now on. Array I/O waits while the spare is
+// written, so no write can land behind the rebuild.
+int raid_failover(uint64 disk_num)
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1)
+        return -1;
+    uint64 slot = disk_slot(currMetadata, disk_num);
+    int spare = currMetadata->swap_disk;
+    if (slot == 0 || spare <= 0 || get_disk_health(spare) != HEALTHY)
+        return -1; // Not a member, or no spare to take its place
+    if (get_disk_health(disk_num) != UNHEALTY)
+        return -1; // Repaired while the failover was queued
+    if (raid_gate_close() == -1)
+        return -1; // Reshape running, the operator has to repair by hand
+
+    acquiresleep(&raid_device.gate_lock);
+    printf("RAID disk %d failed, rebuilding onto spare %d\n", disk_num, spare);
+
+    // Recovery reads members directly, so journaled writes must be home first
+    raid_journal_checkpoint();
+    int err = handle_recovery(currMetadata, failed_members(currMetadata), slot, spare);
+    if (err == 0)
+    {
+        currMetadata->disk_map[slot] = spare;
+        currMetadata->swap_disk = -1;
+        if (currMetadata->journal_disk == disk_num)
+            currMetadata->journal_disk = spare;
+        persist_superblock(currMetadata);
+        if (currMetadata->journal_disk == spare)
+            raid_journal_format(currMetadata);
+        raid_readahead_invalidate_all(); // Cached copies name the failed disk
+        printf("Spare %d replaced disk %d\n", spare, disk_num);
+    }
+    releasesleep(&raid_device.gate_lock);
+    raid_gate_open();
+    return err;
+}
+
 int raid_repair_disk(uint64 disk_num)
 {
     if (disk_num < VIRTIO_RAID_DISK_START || disk_num > VIRTIO_RAID_DISK_END)
@@ -547,15 +1052,25 @@ int raid_repair_disk(uint64 disk_num)
     }
     if (get_disk_health(disk_num) == HEALTHY)
         return 0;
-    uint64 fail_count = 0;
-    // uint64 recovery_count = 0; //will need later for sync // TODO
-    for (int i = 1; i <= VIRTIO_RAID_DISK_END; i++)
+    if (raid_device.exclusive)
+        return -1; // A reshape or spare rebuild is moving data, try again later
+    struct RAIDSuperblock *arrayMetadata;
+    if (load_metadata(&arrayMetadata) == -1)
+        return -1;
+    uint64 slot = disk_slot(arrayMetadata, disk_num);
+    if (slot == 0)
     {
-        enum DISK_HEALTH disk_status = get_disk_health(i);
-        // Ether the disk is healthy or (in recovery, is unhelthy), get_disk_health will load if it's uninitialized
-        if (disk_status == UNHEALTY)
-            fail_count++;
+        // Replaced by the spare earlier; the repaired disk becomes the new spare
+        raid_device.disk_status[disk_num] = HEALTHY;
+        if (arrayMetadata->swap_disk == -1 && disk_num != arrayMetadata->journal_disk)
+        {
+            arrayMetadata->swap_disk = disk_num;
+            persist_superblock(arrayMetadata);
+        }
+        return 0;
     }
+    // uint64 recovery_count = 0; //will need later for sync // TODO
+    uint64 fail_count = failed_members(arrayMetadata);
 
     uchar data[BSIZE];
     read_block(disk_num, 0, data);
@@ -565,10 +1080,17 @@ int raid_repair_disk(uint64 disk_num)
     currMetadata->disk_status = RECOVERY;
     raid_device.disk_status[disk_num] = currMetadata->disk_status;
 
-    int err = handle_recovery(currMetadata, fail_count, disk_num);
+    // Recovery reads members directly, so journaled writes must be home first
+    raid_journal_checkpoint();
+
+    int err = handle_recovery(arrayMetadata, fail_count, slot, disk_num);
     if (err == -1)
         return -1; // Recovery failed
 
+    // A rebuilt journal disk needs its journal header back
+    if (arrayMetadata->journal_disk == disk_num)
+        raid_journal_format(arrayMetadata);
+
     currMetadata->disk_status = HEALTHY;
     raid_device.disk_status[disk_num] = currMetadata->disk_status;
 
@@ -608,12 +1130,24 @@ int raid_system_info(uint64 blkn, uint64 blks, uint64 diskn)
 
 int raid_system_destroy()
 {
+    if (raid_device.mounted)
+        return -1; // The root file system lives on the array
+    raid_wait_background();
+    struct RAIDSuperblock *currMetadata;
+    uint64 data_blocks = 0;
+    if (load_metadata(&currMetadata) == 0)
+        data_blocks = data_blocks_per_disk(currMetadata); // A member journal keeps its header
     uchar data[BSIZE];
     memset(data, 0, BSIZE);
     for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++)
     {
         write_block(i, 0, data);
+        // The host can give back the space of the retired data
+        if (data_blocks > 1)
+            discard_blocks(i, 1, data_blocks - 1);
     }
+    raid_journal_discard();
+    raid_readahead_invalidate_all();
     if (raid_device.is_init != -1)
     {
         kfree(raid_device.superblock);
@@ -622,3 +1156,405 @@ int raid_system_destroy()
     raid_device.superblock = 0;
     return 0;
 }
+
+// Block device entry for a file system on the array; b->data is a kernel
+// buffer and b->blockno a logical block of the array
+int raid_bdev_rw(struct buf *b, int write)
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1 || b->blockno > currMetadata->max_blknum)
+        return -1;
+
+    int locked = raid_io_begin();
+    int err = 0;
+    if (write)
+    {
+        err = rw_block(currMetadata, b->blockno, (uint64)b->data, 0);
+        raid_readahead_invalidate(b->blockno);
+    }
+    else if (raid_readahead_read(b->blockno, b->data) != 0)
+    {
+        err = rw_block(currMetadata, b->blockno, (uint64)b->data, 1);
+    }
+    raid_io_end(locked);
+    return err;
+}
+
+int raid_bdev_flush(void)
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1)
+        return -1;
+    raid_flush_disks();
+    return 0;
+}
+
+// Completion of an async member I/O, called from virtio_disk_intr
+void raid_async_done(struct buf *b)
+{
+    raid_io_end(0);
+}
+
+// Queue a block I/O on the member disks without waiting for it. A write
+// must have its data in b[0].data. Returns the
+// number of bufs queued, or 0 if the I/O has to take the synchronous
+// path: parity updates, mirrored writes, degraded members, a block still
+// in the journal, or a reshape or rebuild moving data. Mirrored writes go
+// through the member disk locks there, so two overlapping writes land in
+// the same order on both copies.
+int raid_async_rw(struct RAIDSuperblock *currMetadata, uint64 block_num, struct buf *b, int write)
+{
+    uint64 disks[2], blkcs[2], parity_disk;
+    int n = 1;
+    switch (currMetadata->raid_level)
+    {
+    case RAID0:
+        raid_map_block(currMetadata, block_num, &disks[0], &blkcs[0], &parity_disk);
+        break;
+    case RAID4:
+    case RAID5:
+        if (write)
+            return 0;
+        raid_map_block(currMetadata, block_num, &disks[0], &blkcs[0], &parity_disk);
+        if (raid_journal_lookup(disks[0], blkcs[0], b[0].data) == 0)
+            return 0;
+        break;
+    case RAID1:
+    case RAID0_1:
+        raid_map_block(currMetadata, block_num, &disks[0], &blkcs[0], &parity_disk);
+        disks[1] = slot_disk(currMetadata, disk_slot(currMetadata, disks[0]) + currMetadata->num_of_disks);
+        blkcs[1] = blkcs[0];
+        n = 2;
+        break;
+    case RAID10_NEAR:
+    case RAID10_FAR:
+        raid10_map_copies(currMetadata, block_num, disks, blkcs);
+        disks[0] = slot_disk(currMetadata, disks[0]);
+        disks[1] = slot_disk(currMetadata, disks[1]);
+        n = 2;
+        break;
+    }
+    if (!write && n == 2 && raid_disk_fail_slow(disks[0]) && !raid_disk_fail_slow(disks[1]))
+    {
+        // A fail-slow disk is the last resort
+        disks[0] = disks[1];
+        blkcs[0] = blkcs[1];
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (get_disk_health(disks[i]) != HEALTHY)
+            return 0;
+    }
+    if (!write)
+        n = 1; // Any healthy copy will do
+    else if (n == 2)
+        return 0; // Both copies must see overlapping writes in one order
+
+    acquire(&raid_device.metadata_lock);
+    if (raid_device.exclusive)
+    {
+        release(&raid_device.metadata_lock);
+        return 0;
+    }
+    raid_device.io_active += n; // Dropped by raid_async_done as each buf completes
+    release(&raid_device.metadata_lock);
+
+    for (int i = 0; i < n; i++)
+    {
+        b[i].dev = disks[i];
+        b[i].blockno = blkcs[i];
+        b[i].done = raid_async_done;
+        b[i].disk = 1;
+    }
+    for (int i = 0; i < n; i++)
+        virtio_disk_submit(disks[i], &b[i], write);
+    if (write)
+        raid_readahead_invalidate(block_num);
+    return n;
+}
+
+// Put the root file system on the array. The first boot creates the
+// array and copies the file system image made by mkfs from the program
+// disk onto it. Runs from forkret, before fsinit.
+void raid_root_init()
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1)
+    {
+        if (raid_system_init(ROOTRAID) != 0 || load_metadata(&currMetadata) == -1)
+            panic("raid_root_init: can't create the array");
+    }
+    if (currMetadata->max_blknum + 1 < FSSIZE)
+        panic("raid_root_init: array too small for the file system");
+    raid_device.mounted = 1;
+
+    // Read block 1 past the buffer cache: the copy below writes the array
+    // with rw_block, which would leave a cached copy of it stale
+    uchar *data = kalloc();
+    if (data == 0)
+        panic("raid_root_init: out of memory");
+    if (rw_block(currMetadata, 1, (uint64)data, 1) == -1)
+        panic("raid_root_init: read failed");
+    int formatted = ((struct superblock *)data)->magic == FSMAGIC;
+    kfree(data);
+    if (formatted)
+        return;
+
+    printf("RAID: copying the file system to the array\n");
+    for (uint i = 0; i < FSSIZE; i++)
+    {
+        struct buf *from = bread(DISKDEV, i);
+        if (rw_block(currMetadata, i, (uint64)from->data, 0) == -1)
+            panic("raid_root_init: write failed");
+        brelse(from);
+    }
+}
+
+// Read one row of the new layout out of the old layout into cols.
+// Blocks past the old end of the array read as zeros.
+void read_reshape_row(struct RAIDSuperblock *currMetadata, uint64 row, uchar **cols, uint64 old_max)
+{
+    uint64 disk_num, blkc_num, parity_disk;
+    for (uint64 c = 0; c < currMetadata->num_of_disks; c++)
+    {
+        uint64 block_num = row * currMetadata->num_of_disks + c;
+        if (block_num > old_max)
+        {
+            memset(cols[c], 0, BSIZE);
+            continue;
+        }
+        map_block_layout(currMetadata, currMetadata->reshape_old_disks, block_num, &disk_num, &blkc_num, &parity_disk);
+        read_block(disk_num, blkc_num, cols[c]);
+    }
+}
+
+// Write one row of the new layout, with freshly computed parity for RAID5
+void write_reshape_row(struct RAIDSuperblock *currMetadata, uint64 row, uchar **cols, uint64 old_max)
+{
+    uint64 disk_num, blkc_num, parity_disk;
+    for (uint64 c = 0; c < currMetadata->num_of_disks; c++)
+    {
+        uint64 block_num = row * currMetadata->num_of_disks + c;
+        if (currMetadata->raid_level == RAID0 && block_num > old_max)
+            break;
+        map_block_layout(currMetadata, currMetadata->num_of_disks, block_num, &disk_num, &blkc_num, &parity_disk);
+        write_block(disk_num, blkc_num, cols[c]);
+    }
+    if (currMetadata->raid_level == RAID5)
+    {
+        uchar *parity = cols[currMetadata->num_of_disks];
+        memset(parity, 0, BSIZE);
+        for (uint64 c = 0; c < currMetadata->num_of_disks; c++)
+            for (int k = 0; k < BSIZE; k++)
+                parity[k] ^= cols[c][k];
+        write_block(parity_disk, blkc_num, parity);
+    }
+}
+
+// First block of the area at the tail of the new disk that holds the
+// reshape backup. Up to one new row for each old disk overlaps its old
+// location, so the area is sized from both geometries
+uint64 reshape_backup_start(struct RAIDSuperblock *currMetadata)
+{
+    return data_blocks_per_disk(currMetadata) - currMetadata->reshape_old_disks * currMetadata->num_of_disks;
+}
+
+// Finish the first rows of an interrupted reshape from their backup
+void raid_reshape_restore(struct RAIDSuperblock *currMetadata)
+{
+    uchar *cols[VIRTIO_RAID_DISK_END + 1];
+    uint64 new_disk = member_disks(currMetadata);
+    uint64 backup = reshape_backup_start(currMetadata);
+    for (int c = 0; c <= currMetadata->num_of_disks; c++)
+        cols[c] = kalloc();
+
+    for (uint64 row = 0; row * currMetadata->num_of_disks < currMetadata->reshape_backup; row++)
+    {
+        for (uint64 c = 0; c < currMetadata->num_of_disks; c++)
+            read_block(new_disk, backup + row * currMetadata->num_of_disks + c, cols[c]);
+        write_reshape_row(currMetadata, row, cols, currMetadata->max_blknum);
+    }
+    currMetadata->reshape_pos = currMetadata->reshape_backup;
+    currMetadata->reshape_backup = 0;
+    persist_superblock(currMetadata);
+
+    for (int c = 0; c <= currMetadata->num_of_disks; c++)
+        kfree(cols[c]);
+}
+
+// Add disk_num to a RAID0/5 array and restripe all data over the new
+// geometry, while the array stays online. Blocks below reshape_pos are
+// already in the new layout. Moving rows in increasing order never
+// overwrites a block that is still needed: row r of the new layout only
+// replaces blocks of old row r, and those all belong to new rows <= r.
+// I/O maps blocks below the watermark to the new layout, so it only
+// moves once the watermark is on disk, after every RAID_RESHAPE_BATCH
+// rows; otherwise a resume would copy those rows again from the old
+// layout over newer writes. It is also persisted before a row would
+// overwrite blocks that are not yet durably moved. The first rows
+// overlap their own old location and are saved on the new disk first. Calling it again resumes a reshape that
+// was interrupted by a restart.
+int raid_expand_disk(uint64 disk_num)
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1)
+    {
+        return -2; // RAID is not initialized
+    }
+    if (currMetadata->raid_level != RAID0 && currMetadata->raid_level != RAID5)
+    {
+        return -1; // Only striped levels can grow by one disk
+    }
+
+    if (currMetadata->reshape_old_disks == 0)
+    {
+        if (disk_num != member_disks(currMetadata) + 1 || disk_num > VIRTIO_RAID_DISK_END ||
+            disk_num == currMetadata->journal_disk || disk_num == currMetadata->swap_disk ||
+            disk_slot(currMetadata, disk_num) != 0)
+        {
+            return -1; // The new disk has to be the next free RAID disk
+        }
+        if (failed_members(currMetadata) > 0 || get_disk_health(disk_num) != HEALTHY)
+            return -1; // Reshape needs every member, degraded arrays can't grow
+        uint64 old_disks = currMetadata->num_of_disks;
+        if (old_disks + old_disks * (old_disks + 1) > data_blocks_per_disk(currMetadata))
+            return -1; // The backup would reach the first rows on the new disk
+
+        // I/O in flight maps blocks with the geometry it started with
+        if (raid_gate_close() == -1)
+            return -1; // Someone else is moving the data
+        acquiresleep(&raid_device.gate_lock);
+        int started = currMetadata->reshape_old_disks != 0;
+        if (!started)
+        {
+            currMetadata->reshape_old_disks = currMetadata->num_of_disks;
+            currMetadata->num_of_disks++;
+            currMetadata->reshape_pos = 0;
+            currMetadata->reshape_backup = 0;
+            persist_superblock(currMetadata);
+        }
+        releasesleep(&raid_device.gate_lock);
+        raid_gate_open();
+        if (started)
+            return -1; // Another caller added a disk meanwhile
+    }
+    else if (disk_num != member_disks(currMetadata))
+    {
+        return -1; // Another disk is being added already
+    }
+
+    // Moving the rows runs in a worker thread, array I/O goes on meanwhile
+    raid_device.reshape_disk = disk_num;
+    queue_work_long(&raid_device.reshape_work);
+    return 0;
+}
+
+// Move the rows of the reshape expand_raid started, or resume it
+void raid_reshape_work(struct work *w)
+{
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1 || currMetadata->reshape_old_disks == 0)
+        return; // Destroyed, or finished by an earlier run
+    uint64 disk_num = raid_device.reshape_disk;
+
+    if (raid_gate_close() == -1)
+    {
+        printf("RAID reshape could not start, call expand_raid to resume\n");
+        return; // Someone else is moving the data
+    }
+    raid_readahead_invalidate_all();
+
+    uint64 old_disks = currMetadata->reshape_old_disks;
+    uint64 new_disks = currMetadata->num_of_disks;
+    uint64 old_max = currMetadata->max_blknum;
+    uint64 new_max;
+    uint64 rows;
+    if (currMetadata->raid_level == RAID0)
+    {
+        uint64 blockPerDisk = (DISK_SIZE * 1024 * 1024) / BSIZE;
+        new_max = (blockPerDisk * new_disks) - new_disks;
+        rows = old_max / new_disks + 1;
+    }
+    else
+    {
+        // RAID5 also zeroes the rows that become free, so their parity is valid
+        new_max = (data_blocks_per_disk(currMetadata) * new_disks) - (new_disks + 1);
+        rows = new_max / new_disks + 1;
+    }
+
+    uchar *cols[VIRTIO_RAID_DISK_END + 1];
+    for (int c = 0; c <= new_disks; c++)
+        cols[c] = kalloc();
+
+    uint64 row = currMetadata->reshape_pos / new_disks;
+    uint64 persisted = currMetadata->reshape_pos;
+    uint64 overlap_rows = old_disks < rows ? old_disks : rows;
+
+    if (row < overlap_rows)
+    {
+        acquiresleep(&raid_device.gate_lock);
+        raid_journal_checkpoint();
+        uint64 backup = reshape_backup_start(currMetadata);
+        for (uint64 r = row; r < overlap_rows; r++)
+        {
+            read_reshape_row(currMetadata, r, cols, old_max);
+            for (uint64 c = 0; c < new_disks; c++)
+                write_block(disk_num, backup + r * new_disks + c, cols[c]);
+        }
+        currMetadata->reshape_backup = overlap_rows * new_disks;
+        persist_superblock(currMetadata);
+
+        for (uint64 r = row; r < overlap_rows; r++)
+        {
+            read_reshape_row(currMetadata, r, cols, old_max);
+            write_reshape_row(currMetadata, r, cols, old_max);
+        }
+        currMetadata->reshape_pos = overlap_rows * new_disks;
+        currMetadata->reshape_backup = 0;
+        persist_superblock(currMetadata);
+        persisted = currMetadata->reshape_pos;
+        releasesleep(&raid_device.gate_lock);
+        row = overlap_rows;
+    }
+
+    while (row < rows)
+    {
+        acquiresleep(&raid_device.gate_lock);
+        // Journal records name physical blocks of the current layout
+        raid_journal_checkpoint();
+
+        uint64 end = row + RAID_RESHAPE_BATCH < rows ? row + RAID_RESHAPE_BATCH : rows;
+        for (; row < end; row++)
+        {
+            // This row overwrites old row `row`, whose blocks must be durably moved
+            if (persisted < row * old_disks + old_disks)
+            {
+                currMetadata->reshape_pos = row * new_disks;
+                persist_superblock(currMetadata);
+                persisted = currMetadata->reshape_pos;
+            }
+            read_reshape_row(currMetadata, row, cols, old_max);
+            write_reshape_row(currMetadata, row, cols, old_max);
+        }
+
+        // Writes below the watermark go to the new layout only, so a
+        // resume must never copy these rows again
+        currMetadata->reshape_pos = row * new_disks;
+        persist_superblock(currMetadata);
+        persisted = currMetadata->reshape_pos;
+        releasesleep(&raid_device.gate_lock);
+    }
+
+    for (int c = 0; c <= new_disks; c++)
+        kfree(cols[c]);
+
+    acquiresleep(&raid_device.gate_lock);
+    currMetadata->max_blknum = new_max;
+    currMetadata->reshape_old_disks = 0;
+    currMetadata->reshape_pos = 0;
+    persist_superblock(currMetadata);
+    releasesleep(&raid_device.gate_lock);
+
+    raid_gate_open();
+    printf("Reshape finished, %d data disks\n", new_disks);
+}
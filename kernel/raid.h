@@ -6,9 +6,22 @@
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "workqueue.h"
 
 #define OFFSET_MASK 0x0000000000000FFF
 
+#define RAID_JOURNAL_MAGIC 0x4a524e4c // "JRNL"
+#define RAID_JOURNAL_BLOCKS 256       // blocks reserved for the stripe journal
+#define RAID_JOURNAL_RECORD 3         // data, parity and descriptor block
+#define RAID_JOURNAL_SLOTS ((RAID_JOURNAL_BLOCKS - 1) / RAID_JOURNAL_RECORD)
+#define RAID_JOURNAL_BACKGROUND (RAID_JOURNAL_SLOTS / 2) // records that start a background checkpoint
+
+#define RAID_RING_ENTRIES 64 // ring slots, also the most ring I/Os in flight per process
+#define RAID_RING_READ 0
+#define RAID_RING_WRITE 1
+
+#define RAID_RESHAPE_BATCH 16 // rows moved per hold of gate_lock, the watermark is persisted after each batch
+
 enum RAID_DISK_ROLE
 {
     DATA_DISK,
@@ -32,6 +45,51 @@ struct RAIDSuperblock
     uint max_blknum;
     uint blk_size;
     uint num_of_disks;
+    int journal_disk;   // disk holding the RAID4/5 stripe journal, -1 if there is none
+    uint journal_start; // first block of the journal region on journal_disk
+    uint reshape_old_disks; // num_of_disks before expand_raid, 0 if no reshape is running
+    uint reshape_pos;       // blocks below this are already in the new layout
+    uint reshape_backup;    // blocks of the first rows saved on the new disk, 0 if none
+    uchar disk_map[VIRTIO_RAID_DISK_END + 1]; // disk standing in for each member slot, 0 if the slot's own
+};
+
+// First block of the journal region, points at the oldest record not yet applied
+struct RAIDJournalHeader
+{
+    uint magic;
+    uint seq; // sequence number of the record in slot 0
+};
+
+// Last block of each journal record, written after its data and parity blocks
+struct RAIDJournalRecord
+{
+    uint magic;
+    uint seq;
+    uint data_disk;
+    uint parity_disk;
+    uint blkc_num;
+    uint checksum; // over data and parity block, detects torn records
+};
+
+struct RAIDJournalEntry
+{
+    uint data_disk;
+    uint parity_disk;
+    uint blkc_num;
+    uchar *data; // new data block followed by the new parity block
+};
+
+struct RAIDJournal
+{
+    int disk; // -1 when the array runs without a journal
+    uint start;
+    uint seq;   // sequence number of slot 0
+    int count;  // records appended but not yet applied to home locations
+    int loaded; // journal was replayed or formatted for the current superblock
+    struct RAIDJournalEntry entries[RAID_JOURNAL_SLOTS];
+    struct sleeplock lock;        // serializes journal I/O (append, checkpoint, replay)
+    struct spinlock entries_lock; // protects entries/count for readers
+    struct work checkpoint_work;  // checkpoints in the background before the journal fills up
 };
 
 struct RAIDDisks
@@ -46,9 +104,72 @@ struct RAIDDevice
     struct RAIDSuperblock *superblock; // Metadata for the RAID type, cached
     struct RAIDDisks disks[VIRTIO_RAID_DISK_END + 1];
     struct spinlock metadata_lock; // protects is_init/superblock/disk_status cache
+    int exclusive;              // a reshape or rebuild is moving data, I/O goes through gate_lock
+    int io_active;              // I/O running without gate_lock, drained before exclusive is set
+    struct sleeplock gate_lock; // held by the reshaper for one row, the rebuilder, or one I/O
+    int mounted;                // the root file system lives on the array
+    struct work failover_work;  // rebuilds onto the spare, off the caller's syscall
+    uint64 failover_pending;    // failed disks waiting for failover_work, one bit each
+    struct work reshape_work;   // runs the reshape expand_raid started
+    uint64 reshape_disk;        // disk being added by reshape_work
+};
+
+// Submission queue entry, filled in by the process
+struct RAIDRingSQE
+{
+    uint64 addr;      // user buffer of one block
+    uint blkn;        // logical block of the array
+    uint op;          // RAID_RING_READ or RAID_RING_WRITE
+    uint64 user_data; // copied to the completion
+};
+
+// Completion queue entry, filled in by the kernel
+struct RAIDRingCQE
+{
+    uint64 user_data;
+    int res; // 0 on success, -1 on error
+    uint reserved;
+};
+
+// Page shared between the kernel and the process. Indexes only grow,
+// a slot is index % RAID_RING_ENTRIES.
+struct RAIDRing
+{
+    uint sq_head; // next submission the kernel takes, written by the kernel
+    uint sq_tail; // next free submission slot, written by the process
+    uint cq_head; // next completion the process reaps, written by the process
+    uint cq_tail; // next free completion slot, written by the kernel
+    struct RAIDRingSQE sq[RAID_RING_ENTRIES];
+    struct RAIDRingCQE cq[RAID_RING_ENTRIES];
+};
+
+struct RAIDRingState
+{
+    struct RAIDRing *ring; // kernel address of the shared page
+    int count;             // requests not yet posted to the completion queue
+    struct RAIDRingRequest *reqs[RAID_RING_ENTRIES];
 };
 
 void init_raid_device();
+enum DISK_HEALTH get_disk_health(int disk_num);
+void raid_map_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 *disk_num, uint64 *blkc_num, uint64 *parity_disk);
+uint64 member_disks(struct RAIDSuperblock *currMetadata);
+uint64 slot_disk(struct RAIDSuperblock *currMetadata, uint64 slot);
+uint64 disk_slot(struct RAIDSuperblock *currMetadata, uint64 disk_num);
+
+void init_raid_journal();
+void raid_journal_load(struct RAIDSuperblock *superblock);
+void raid_journal_format(struct RAIDSuperblock *superblock);
+int raid_journal_append(uint64 data_disk, uint64 parity_disk, uint64 blkc_num, uchar *data, uchar *parity);
+int raid_journal_lookup(uint64 disk, uint64 blkc_num, uchar *data);
+void raid_journal_checkpoint();
+void raid_journal_discard();
+
+void init_raid_readahead();
+int raid_readahead_read(uint64 block_num, uchar *data);
+void raid_readahead_advance(struct RAIDSuperblock *currMetadata, uint64 block_num);
+void raid_readahead_invalidate(uint64 block_num);
+void raid_readahead_invalidate_all();
 
 int raid_system_init(enum RAID_TYPE raid_type);
 int raid_read_block(uint64 blkn, uint64 buffAddr);
@@ -57,5 +178,28 @@ int raid_fail_disk(uint64 disk_num);
 int raid_repair_disk(uint64 disk_num);
 int raid_system_info(uint64 blkn, uint64 blks, uint64 diskn);
 int raid_system_destroy();
+int raid_expand_disk(uint64 disk_num);
+int raid_trim(uint64 start_blk, uint64 count);
+int raid_failover(uint64 disk_num);
+void raid_failover_work(struct work *w);
+void raid_reshape_work(struct work *w);
+void raid_wait_background();
+void raid_reshape_restore(struct RAIDSuperblock *superblock);
+int load_metadata(struct RAIDSuperblock **metadata);
+int rw_block(struct RAIDSuperblock *currMetadata, uint64 block_num, uint64 p_buff, int isRead);
+void raid_flush_disks();
+int raid_io_begin();
+int raid_io_try_begin();
+void raid_io_end(int locked);
+int raid_async_rw(struct RAIDSuperblock *currMetadata, uint64 block_num, struct buf *b, int write);
+
+void init_raid_latency();
+void raid_latency_sample(uint64 disk, uint64 t);
+int raid_disk_fail_slow(uint64 disk);
+void raid_timed_write(uint64 disk, uint64 blkc_num, uchar *data);
+int raid_mirror_read(uint64 *disks, uint64 *blkcs, uchar *data);
+
+int raid_ring_setup(uint64 ring_addr);
+int raid_ring_enter(int to_submit, int min_complete);
 
 #endif
@@ -0,0 +1,337 @@
+// Stripe journal for RAID4/5 writes.
+//
+// A RAID4/5 write updates a data block and its parity block with two
+// separate disk writes. A crash between them leaves the stripe with
+// parity that does not match its data (the "write hole"). To close it
+// the new data and parity are first appended to the journal, and only
+// then written to their home locations.
+//
+// On-disk layout of the journal region on journal_disk:
+//   header block (struct RAIDJournalHeader)
+//   record 0: data block | parity block | descriptor (struct RAIDJournalRecord)
+//   record 1: ...
+//
+// Records are appended sequentially, so small random writes to the
+// array become sequential writes to the journal. A write is complete
+// once its record is on disk; applying records to home locations is
+// deferred until the journal is half full, then a worker thread does
+// it (a checkpoint). An append that finds the journal full checkpoints
+// itself. After a crash, raid_journal_load() replays every record whose
+// sequence number and checksum are valid, which replaces a full resync
+// of the array.
+//
+// The disks may cache writes. A record needs no flush of its own, its
+// checksum catches one that is torn. Records are flushed before their
+// home locations are written, and home locations before the header
+// drops the records.
+
+#include "raid.h"
+#include "defs.h"
+#include "fs.h"
+#include "param.h"
+
+static struct RAIDJournal journal;
+
+static uint journal_checksum(uchar *data, uint len, uint seq)
+{
+    uint sum = 2166136261u ^ seq; // FNV-1a, seeded with the record sequence
+    for (uint i = 0; i < len; i++)
+    {
+        sum ^= data[i];
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+static int journal_disk_healthy()
+{
+    if (journal.disk > VIRTIO_RAID_DISK_END)
+        return 1; // Dedicated log disk, not part of the array
+    return get_disk_health(journal.disk) == HEALTHY;
+}
+
+static uint64 record_block(int slot)
+{
+    return journal.start + 1 + slot * RAID_JOURNAL_RECORD;
+}
+
+static void write_header()
+{
+    uchar *data = kalloc();
+    if (data == 0)
+        panic("raid_journal: out of memory"); // Records of the old seq would stay valid
+    memset(data, 0, BSIZE);
+    struct RAIDJournalHeader *header = (struct RAIDJournalHeader *)data;
+    header->magic = RAID_JOURNAL_MAGIC;
+    header->seq = journal.seq;
+    write_block(journal.disk, journal.start, data);
+    kfree(data);
+}
+
+// Drop in-memory records without applying them
+static void discard_entries()
+{
+    acquire(&journal.entries_lock);
+    for (int i = 0; i < journal.count; i++)
+    {
+        kfree(journal.entries[i].data);
+        journal.entries[i].data = 0;
+    }
+    journal.count = 0;
+    release(&journal.entries_lock);
+}
+
+// Apply all pending records to their home locations, then mark them
+// applied in the header. Caller must hold journal.lock.
+static void checkpoint_locked()
+{
+    if (journal.count == 0)
+        return;
+
+    // Entries are stable here: only append and checkpoint change them,
+    // and both hold journal.lock. Readers keep finding the journal copy
+    // until the home write has landed.
+    virtio_disk_flush(journal.disk);
+    for (int i = 0; i < journal.count; i++)
+    {
+        struct RAIDJournalEntry *entry = &journal.entries[i];
+        write_block(entry->parity_disk, entry->blkc_num, entry->data + BSIZE);
+        write_block(entry->data_disk, entry->blkc_num, entry->data);
+    }
+
+    // Prefetches that raced with these writes may hold the old home copy
+    raid_readahead_invalidate_all();
+
+    raid_flush_disks();
+    journal.seq += journal.count;
+    write_header();
+    discard_entries();
+}
+
+// Checkpoint from a worker thread, so appends rarely find the journal full
+static void checkpoint_work(struct work *w)
+{
+    int locked = raid_io_begin();
+    raid_journal_checkpoint();
+    raid_io_end(locked);
+}
+
+void init_raid_journal()
+{
+    initsleeplock(&journal.lock, "raid_journal");
+    initlock(&journal.entries_lock, "raid_journal_entries");
+    journal.disk = -1;
+    journal.loaded = 0;
+    journal.count = 0;
+    init_work(&journal.checkpoint_work, checkpoint_work);
+}
+
+// Replay records left behind by a crash. Called once after the superblock
+// is read from disk; later calls for the same superblock do nothing.
+void raid_journal_load(struct RAIDSuperblock *superblock)
+{
+    acquiresleep(&journal.lock);
+    if (journal.loaded)
+    {
+        releasesleep(&journal.lock);
+        return;
+    }
+    journal.loaded = 1;
+    journal.disk = superblock->journal_disk;
+    journal.start = superblock->journal_start;
+    journal.count = 0;
+    if (journal.disk <= 0)
+    {
+        releasesleep(&journal.lock);
+        return;
+    }
+
+    uchar *data = kalloc();
+    if (data == 0)
+        panic("raid_journal_load: out of memory"); // Can't replay, and I/O must not start without it
+    read_block(journal.disk, journal.start, data);
+    struct RAIDJournalHeader *header = (struct RAIDJournalHeader *)data;
+    if (header->magic != RAID_JOURNAL_MAGIC)
+    {
+        // Never formatted (or lost with its disk), nothing to replay
+        kfree(data);
+        journal.seq = 1;
+        write_header();
+        releasesleep(&journal.lock);
+        return;
+    }
+    journal.seq = header->seq;
+
+    // data holds the record's data and parity block, desc its descriptor
+    uchar *desc = data + 2 * BSIZE;
+    struct RAIDJournalRecord *record = (struct RAIDJournalRecord *)desc;
+    int replayed = 0;
+    for (int slot = 0; slot < RAID_JOURNAL_SLOTS; slot++)
+    {
+        uint64 blk = record_block(slot);
+        read_block(journal.disk, blk + 2, desc);
+        if (record->magic != RAID_JOURNAL_MAGIC || record->seq != journal.seq + slot)
+            break; // End of the log
+
+        read_block(journal.disk, blk, data);
+        read_block(journal.disk, blk + 1, data + BSIZE);
+        if (journal_checksum(data, 2 * BSIZE, record->seq) != record->checksum)
+            break; // Torn record, its home locations were never touched
+
+        write_block(record->parity_disk, record->blkc_num, data + BSIZE);
+        write_block(record->data_disk, record->blkc_num, data);
+        replayed++;
+    }
+    kfree(data);
+
+    raid_flush_disks();
+    journal.seq += replayed;
+    write_header();
+    if (replayed > 0)
+        printf("RAID journal: replayed %d stripe writes\n", replayed);
+    releasesleep(&journal.lock);
+}
+
+// Start an empty journal for a freshly initialized array, or write the
+// header again after the journal disk was rebuilt
+void raid_journal_format(struct RAIDSuperblock *superblock)
+{
+    acquiresleep(&journal.lock);
+    if (journal.loaded && journal.disk > 0)
+        checkpoint_locked(); // Rewriting the header of a live journal
+    journal.loaded = 1;
+    journal.disk = superblock->journal_disk;
+    journal.start = superblock->journal_start;
+    journal.seq = 1;
+    if (journal.disk > 0)
+    {
+        // Records of an earlier journal at this spot must never look valid,
+        // so continue past every sequence number they could carry
+        uchar *data = kalloc();
+        if (data == 0)
+            panic("raid_journal_format: out of memory"); // Can't tell which records are stale
+        read_block(journal.disk, journal.start, data);
+        struct RAIDJournalHeader *header = (struct RAIDJournalHeader *)data;
+        if (header->magic == RAID_JOURNAL_MAGIC)
+            journal.seq = header->seq + RAID_JOURNAL_SLOTS;
+        kfree(data);
+        write_header();
+    }
+    releasesleep(&journal.lock);
+}
+
+// Append new data and parity for one stripe block. Returns 0 once the
+// record is on disk, or -1 if there is no usable journal and the caller
+// must write the home locations itself.
+int raid_journal_append(uint64 data_disk, uint64 parity_disk, uint64 blkc_num, uchar *data, uchar *parity)
+{
+    acquiresleep(&journal.lock);
+    if (journal.disk <= 0)
+    {
+        releasesleep(&journal.lock);
+        return -1;
+    }
+    if (!journal_disk_healthy())
+    {
+        // Flush what is already logged, the caller falls back to write-through
+        checkpoint_locked();
+        releasesleep(&journal.lock);
+        return -1;
+    }
+    if (journal.count == RAID_JOURNAL_SLOTS)
+        checkpoint_locked();
+
+    int slot = journal.count;
+    uint64 blk = record_block(slot);
+    uchar *entry_data = kalloc();
+    uchar *desc = kalloc(); // Kernel stack is a single page, keep blocks off it
+    if (entry_data == 0 || desc == 0)
+    {
+        if (entry_data)
+            kfree(entry_data);
+        if (desc)
+            kfree(desc);
+        // Older records of this block must not land over the write-through
+        checkpoint_locked();
+        releasesleep(&journal.lock);
+        return -1;
+    }
+    memmove(entry_data, data, BSIZE);
+    memmove(entry_data + BSIZE, parity, BSIZE);
+
+    memset(desc, 0, BSIZE);
+    struct RAIDJournalRecord *record = (struct RAIDJournalRecord *)desc;
+    record->magic = RAID_JOURNAL_MAGIC;
+    record->seq = journal.seq + slot;
+    record->data_disk = data_disk;
+    record->parity_disk = parity_disk;
+    record->blkc_num = blkc_num;
+    record->checksum = journal_checksum(entry_data, 2 * BSIZE, record->seq);
+
+    // Sequential append; the descriptor goes last and commits the record
+    write_block(journal.disk, blk, entry_data);
+    write_block(journal.disk, blk + 1, entry_data + BSIZE);
+    write_block(journal.disk, blk + 2, desc);
+    kfree(desc);
+
+    acquire(&journal.entries_lock);
+    journal.entries[slot].data_disk = data_disk;
+    journal.entries[slot].parity_disk = parity_disk;
+    journal.entries[slot].blkc_num = blkc_num;
+    journal.entries[slot].data = entry_data;
+    journal.count++;
+    release(&journal.entries_lock);
+
+    if (journal.count >= RAID_JOURNAL_BACKGROUND)
+        queue_work_long(&journal.checkpoint_work);
+    releasesleep(&journal.lock);
+    return 0;
+}
+
+// Copy the newest journaled version of a member block into data.
+// Returns 0 on a hit, -1 if the home location is up to date.
+int raid_journal_lookup(uint64 disk, uint64 blkc_num, uchar *data)
+{
+    int found = -1;
+    acquire(&journal.entries_lock);
+    for (int i = journal.count - 1; i >= 0; i--)
+    {
+        struct RAIDJournalEntry *entry = &journal.entries[i];
+        if (entry->blkc_num != blkc_num)
+            continue;
+        if (entry->data_disk == disk)
+        {
+            memmove(data, entry->data, BSIZE);
+            found = 0;
+            break;
+        }
+        if (entry->parity_disk == disk)
+        {
+            memmove(data, entry->data + BSIZE, BSIZE);
+            found = 0;
+            break;
+        }
+    }
+    release(&journal.entries_lock);
+    return found;
+}
+
+// Apply every pending record, e.g. before a rebuild reads members directly
+void raid_journal_checkpoint()
+{
+    acquiresleep(&journal.lock);
+    if (journal.disk > 0)
+        checkpoint_locked();
+    releasesleep(&journal.lock);
+}
+
+// Forget the journal of a destroyed array
+void raid_journal_discard()
+{
+    flush_work(&journal.checkpoint_work);
+    acquiresleep(&journal.lock);
+    discard_entries();
+    journal.disk = -1;
+    journal.loaded = 0;
+    releasesleep(&journal.lock);
+}
@@ -0,0 +1,286 @@
+// Member service times, hedged mirror reads and fail-slow detection.
+//
+// Timed member I/O feeds a per-disk EWMA and a log2 histogram of the
+// service time, in r_time() units. A mirrored read goes to one copy
+// first. If it is still running after both RAID_HEDGE_FACTOR times the
+// disk's EWMA and its p99, the block is read from the other copy as
+// well and whichever finishes first is used. A disk whose EWMA grows
+// to RAID_FAIL_SLOW_FACTOR times that of the fastest disk is flagged
+// fail-slow and read only when no other copy is left.
+
+#include "raid.h"
+#include "defs.h"
+#include "fs.h"
+#include "param.h"
+#include "buf.h"
+
+#define RAID_LAT_BUCKETS 40        // histogram bucket b counts times in [2^b, 2^(b+1))
+#define RAID_LAT_DECAY 1024        // histogram is halved at this many samples
+#define RAID_LAT_MIN_SAMPLES 64    // samples before a disk is judged
+#define RAID_HEDGE_FACTOR 4        // hedge after this many EWMAs
+#define RAID_HEDGE_DEFAULT 10000000 // hedge limit without samples, about a second on qemu
+#define RAID_FAIL_SLOW_FACTOR 8    // EWMA over the fastest disk's that makes a disk fail-slow
+
+struct RAIDDiskLatency
+{
+    uint64 ewma;    // service time, 1/8 weight for each new sample
+    uint64 samples; // samples ever taken
+    uint total;     // samples in hist
+    uint hist[RAID_LAT_BUCKETS];
+    int fail_slow;
+};
+
+static struct
+{
+    struct spinlock lock; // also protects RAIDHedge refs, winner and next
+    struct RAIDDiskLatency disks[VIRTIO_RAID_DISK_END + 1];
+    struct RAIDHedge *waiting; // readers that haven't hedged yet
+} lat;
+
+// One hedged read. kalloc'd, so a buf finds its RAIDHedge by rounding
+// its address down to the page.
+struct RAIDHedge
+{
+    int refs;   // reader plus bufs still in flight
+    int winner; // first buf that finished, -1 while none has
+    uint64 deadline;         // r_time() the reader hedges at
+    struct RAIDHedge *next;  // on lat.waiting until the reader hedges
+    uint64 start[2];
+    struct buf b[2];
+};
+
+void init_raid_latency()
+{
+    initlock(&lat.lock, "raid_latency");
+}
+
+static int bucket(uint64 t)
+{
+    int b = 0;
+    while (t > 1 && b < RAID_LAT_BUCKETS - 1)
+    {
+        t >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// Upper bound of the pct-th percentile. Caller must hold lat.lock
+static uint64 percentile(struct RAIDDiskLatency *d, uint pct)
+{
+    uint want = (d->total * pct + 99) / 100;
+    uint seen = 0;
+    for (int b = 0; b < RAID_LAT_BUCKETS; b++)
+    {
+        seen += d->hist[b];
+        if (seen >= want)
+            return 2ull << b;
+    }
+    return 2ull << (RAID_LAT_BUCKETS - 1);
+}
+
+// Caller must hold lat.lock
+static void update_fail_slow(uint64 disk)
+{
+    struct RAIDDiskLatency *d = &lat.disks[disk];
+    if (d->samples < RAID_LAT_MIN_SAMPLES)
+        return;
+
+    uint64 best = d->ewma;
+    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++)
+    {
+        struct RAIDDiskLatency *other = &lat.disks[i];
+        if (other->samples >= RAID_LAT_MIN_SAMPLES && other->ewma < best)
+            best = other->ewma;
+    }
+    if (!d->fail_slow && d->ewma > best * RAID_FAIL_SLOW_FACTOR)
+    {
+        d->fail_slow = 1;
+        printf("RAID disk %d is fail-slow\n", (int)disk);
+    }
+    else if (d->fail_slow && d->ewma <= best * RAID_FAIL_SLOW_FACTOR / 2)
+    {
+        d->fail_slow = 0;
+        printf("RAID disk %d is no longer fail-slow\n", (int)disk);
+    }
+}
+
+void raid_latency_sample(uint64 disk, uint64 t)
+{
+    if (disk < VIRTIO_RAID_DISK_START || disk > VIRTIO_RAID_DISK_END)
+        return;
+
+    acquire(&lat.lock);
+    struct RAIDDiskLatency *d = &lat.disks[disk];
+    d->ewma = d->samples == 0 ? t : d->ewma - d->ewma / 8 + t / 8;
+    d->samples++;
+    d->hist[bucket(t)]++;
+    if (++d->total >= RAID_LAT_DECAY)
+    {
+        // Old samples fade out, so a disk that recovers is seen recovering
+        d->total = 0;
+        for (int b = 0; b < RAID_LAT_BUCKETS; b++)
+        {
+            d->hist[b] /= 2;
+            d->total += d->hist[b];
+        }
+    }
+    update_fail_slow(disk);
+    release(&lat.lock);
+}
+
+int raid_disk_fail_slow(uint64 disk)
+{
+    if (disk < VIRTIO_RAID_DISK_START || disk > VIRTIO_RAID_DISK_END)
+        return 0;
+    return lat.disks[disk].fail_slow;
+}
+
+// write_block that records the disk's service time
+void raid_timed_write(uint64 disk, uint64 blkc_num, uchar *data)
+{
+    uint64 start = r_time();
+    write_block(disk, blkc_num, data);
+    raid_latency_sample(disk, r_time() - start);
+}
+
+// How long a read of disk may run before it is hedged
+static uint64 hedge_limit(uint64 disk)
+{
+    acquire(&lat.lock);
+    struct RAIDDiskLatency *d = &lat.disks[disk];
+    uint64 limit = RAID_HEDGE_DEFAULT;
+    if (d->samples >= RAID_LAT_MIN_SAMPLES)
+    {
+        limit = d->ewma * RAID_HEDGE_FACTOR;
+        uint64 p99 = percentile(d, 99);
+        if (p99 > limit)
+            limit = p99;
+    }
+    release(&lat.lock);
+    return limit;
+}
+
+// Completion of a hedged read buf, called from virtio_disk_intr
+static void hedge_done(struct buf *b)
+{
+    struct RAIDHedge *h = (struct RAIDHedge *)PGROUNDDOWN((uint64)b);
+    int i = b - h->b;
+    raid_latency_sample(b->dev, r_time() - h->start[i]);
+
+    acquire(&lat.lock);
+    if (h->winner < 0)
+        h->winner = i;
+    int last = --h->refs == 0;
+    if (!last)
+        wakeup(h);
+    release(&lat.lock);
+
+    if (last)
+        kfree(h); // The loser of the race is freed here
+}
+
+// Wake readers whose deadline to hedge has passed, called from clockintr
+void raid_latency_tick(void)
+{
+    if (lat.waiting == 0)
+        return; // Checked again at the next tick if a reader is just going to sleep
+
+    acquire(&lat.lock);
+    uint64 now = r_time();
+    for (struct RAIDHedge *h = lat.waiting; h; h = h->next)
+    {
+        if (now >= h->deadline)
+            wakeup(h);
+    }
+    release(&lat.lock);
+}
+
+// Caller must hold lat.lock
+static void hedge_unwait(struct RAIDHedge *h)
+{
+    struct RAIDHedge **pp = &lat.waiting;
+    while (*pp != h)
+        pp = &(*pp)->next;
+    *pp = h->next;
+}
+
+static void hedge_submit(struct RAIDHedge *h, int i, uint64 disk, uint64 blkc_num)
+{
+    acquire(&lat.lock);
+    h->refs++;
+    release(&lat.lock);
+
+    h->b[i].dev = disk;
+    h->b[i].blockno = blkc_num;
+    h->b[i].done = hedge_done;
+    h->b[i].disk = 1;
+    h->start[i] = r_time();
+    virtio_disk_submit(disk, &h->b[i], 0);
+}
+
+// Read a block that has copies at (disks[0], blkcs[0]) and (disks[1], blkcs[1]).
+// The first copy is preferred unless its disk is fail-slow. Returns -1
+// if no copy is on a healthy disk.
+int raid_mirror_read(uint64 *disks, uint64 *blkcs, uchar *data)
+{
+    int usable[2];
+    for (int k = 0; k < 2; k++)
+        usable[k] = get_disk_health(disks[k]) == HEALTHY;
+    if (!usable[0] && !usable[1])
+        return -1;
+
+    int first = usable[0] ? 0 : 1;
+    if (usable[0] && usable[1] && raid_disk_fail_slow(disks[0]) && !raid_disk_fail_slow(disks[1]))
+        first = 1; // A fail-slow disk is the last resort
+    int second = usable[1 - first] ? 1 - first : -1;
+
+    struct RAIDHedge *h = kalloc();
+    if (h == 0)
+    {
+        // Nothing to hedge with, so just wait for the first copy
+        uint64 start = r_time();
+        read_block(disks[first], blkcs[first], data);
+        raid_latency_sample(disks[first], r_time() - start);
+        return 0;
+    }
+    h->refs = 1;
+    h->winner = -1;
+    hedge_submit(h, first, disks[first], blkcs[first]);
+    uint64 limit = hedge_limit(disks[first]);
+
+    // hedge_done wakes the reader, and so does raid_latency_tick once
+    // it is time to hedge
+    acquire(&lat.lock);
+    if (second >= 0)
+    {
+        h->deadline = h->start[first] + limit;
+        h->next = lat.waiting;
+        lat.waiting = h;
+    }
+    while (h->winner < 0)
+    {
+        if (second >= 0 && r_time() >= h->deadline)
+        {
+            hedge_unwait(h);
+            release(&lat.lock);
+            hedge_submit(h, second, disks[second], blkcs[second]);
+            second = -1;
+            acquire(&lat.lock);
+            continue;
+        }
+        sleep(h, &lat.lock);
+    }
+    if (second >= 0)
+        hedge_unwait(h);
+    int winner = h->winner;
+    release(&lat.lock);
+
+    memmove(data, h->b[winner].data, BSIZE);
+    acquire(&lat.lock);
+    int last = --h->refs == 0;
+    release(&lat.lock);
+    if (last)
+        kfree(h);
+    return 0;
+}
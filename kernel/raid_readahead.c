@@ -0,0 +1,232 @@
+// Sequential read-ahead for read_raid.
+//
+// Every process tracks the block that would continue its current
+// sequential stream (p->raid_ra_next). While a process keeps reading
+// the next block, the window of blocks it prefetches doubles from
+// RAID_RA_MIN up to RAID_RA_MAX. The reader only notes the blocks to
+// prefetch; a worker thread maps them and queues them on the member
+// disks with virtio_disk_submit(). They land in a small cache shared by
+// all processes, so a scan keeps every member of the stripe busy
+// instead of paying the latency of one disk per block.
+//
+// Cache entries are keyed by logical block. A write to a cached block
+// invalidates it; an entry whose prefetch is still in flight is marked
+// stale and dropped once the disk is done with it.
+
+#include "raid.h"
+#include "defs.h"
+#include "fs.h"
+#include "param.h"
+#include "proc.h"
+#include "buf.h"
+
+#define RAID_RA_CACHE 32 // blocks in the read-ahead cache
+#define RAID_RA_MIN 4    // first window of a sequential stream
+#define RAID_RA_MAX 16   // largest window, half of the cache
+#define RAID_RA_PENDING 64 // blocks noted for the worker, more are dropped
+#define RAID_RA_NONE ((uint64)-1)
+
+struct RAIDCacheBlock
+{
+    uint64 block_num; // logical block, RAID_RA_NONE if the entry is free
+    int stale;        // a write hit the block while it was prefetched
+    uint lru;         // cache.clock of the last use
+    struct buf b;     // b.dev is the member disk, b.disk is set while in flight
+};
+
+static struct
+{
+    struct spinlock lock;
+    uint clock;
+    struct RAIDCacheBlock blocks[RAID_RA_CACHE];
+    uint64 pending[RAID_RA_PENDING]; // blocks to prefetch, a ring
+    uint pending_head;
+    uint pending_tail;
+    struct work work;
+} cache;
+
+static void prefetch_work(struct work *w);
+
+void init_raid_readahead()
+{
+    initlock(&cache.lock, "raid_readahead");
+    for (int i = 0; i < RAID_RA_CACHE; i++)
+    {
+        cache.blocks[i].block_num = RAID_RA_NONE;
+        initsleeplock(&cache.blocks[i].b.lock, "raid_readahead_buf");
+    }
+    init_work(&cache.work, prefetch_work);
+}
+
+static int is_busy(struct RAIDCacheBlock *entry)
+{
+    return entry->b.disk || entry->b.refcnt > 0;
+}
+
+// Caller must hold cache.lock
+static struct RAIDCacheBlock *lookup(uint64 block_num)
+{
+    for (int i = 0; i < RAID_RA_CACHE; i++)
+    {
+        struct RAIDCacheBlock *entry = &cache.blocks[i];
+        if (entry->block_num == block_num && !entry->stale)
+            return entry;
+    }
+    return 0;
+}
+
+// Free, stale or least recently used idle entry. Caller must hold cache.lock
+static struct RAIDCacheBlock *victim()
+{
+    struct RAIDCacheBlock *best = 0;
+    for (int i = 0; i < RAID_RA_CACHE; i++)
+    {
+        struct RAIDCacheBlock *entry = &cache.blocks[i];
+        if (is_busy(entry))
+            continue;
+        if (entry->block_num == RAID_RA_NONE || entry->stale)
+            return entry;
+        if (best == 0 || entry->lru < best->lru)
+            best = entry;
+    }
+    return best;
+}
+
+static void prefetch(struct RAIDSuperblock *currMetadata, uint64 block_num)
+{
+    uint64 disk_num, blkc_num, parity_disk;
+    raid_map_block(currMetadata, block_num, &disk_num, &blkc_num, &parity_disk);
+    if (get_disk_health(disk_num) != HEALTHY)
+        return; // Degraded reads stay on the synchronous path
+
+    acquire(&cache.lock);
+    struct RAIDCacheBlock *entry;
+    if (lookup(block_num) != 0 || (entry = victim()) == 0)
+    {
+        release(&cache.lock);
+        return;
+    }
+    entry->block_num = block_num;
+    entry->stale = 0;
+    entry->lru = ++cache.clock;
+    entry->b.dev = disk_num;
+    entry->b.blockno = blkc_num;
+    entry->b.disk = 1; // In flight from now on, readers will wait for it
+    release(&cache.lock);
+
+    virtio_disk_submit(disk_num, &entry->b, 0);
+}
+
+// Issue the prefetches readers noted, from a worker thread
+static void prefetch_work(struct work *w)
+{
+    struct RAIDSuperblock *currMetadata;
+    int usable = load_metadata(&currMetadata) == 0 && raid_io_try_begin() == 0;
+    for (;;)
+    {
+        acquire(&cache.lock);
+        if (cache.pending_head == cache.pending_tail)
+        {
+            release(&cache.lock);
+            break;
+        }
+        uint64 block_num = cache.pending[cache.pending_head++ % RAID_RA_PENDING];
+        release(&cache.lock);
+
+        // Dropped while data moves, or if the array changed meanwhile
+        if (usable && currMetadata->reshape_old_disks == 0 && block_num <= currMetadata->max_blknum)
+            prefetch(currMetadata, block_num);
+    }
+    if (usable)
+        raid_io_end(0);
+}
+
+// Serve a read from the read-ahead cache, waiting for the prefetch if it
+// is still in flight. Returns 0 on a hit, -1 if the caller must read.
+int raid_readahead_read(uint64 block_num, uchar *data)
+{
+    acquire(&cache.lock);
+    struct RAIDCacheBlock *entry = lookup(block_num);
+    if (entry == 0)
+    {
+        release(&cache.lock);
+        return -1;
+    }
+    entry->b.refcnt++;
+    entry->lru = ++cache.clock;
+    release(&cache.lock);
+
+    if (entry->b.disk)
+        virtio_disk_wait(entry->b.dev, &entry->b);
+
+    acquire(&cache.lock);
+    int hit = !entry->stale;
+    if (hit && raid_journal_lookup(entry->b.dev, entry->b.blockno, data) == -1)
+        memmove(data, entry->b.data, BSIZE);
+    entry->b.refcnt--;
+    release(&cache.lock);
+
+    return hit ? 0 : -1;
+}
+
+// Track the calling process's stream and prefetch ahead of it
+void raid_readahead_advance(struct RAIDSuperblock *currMetadata, uint64 block_num)
+{
+    struct proc *p = myproc();
+    if (currMetadata->reshape_old_disks != 0)
+        return; // Blocks are moving between disks, cached copies would go stale
+
+    if (block_num == p->raid_ra_next)
+    {
+        p->raid_ra_window = p->raid_ra_window == 0 ? RAID_RA_MIN : p->raid_ra_window * 2;
+        if (p->raid_ra_window > RAID_RA_MAX)
+            p->raid_ra_window = RAID_RA_MAX;
+    }
+    else
+    {
+        // Random access, start over
+        p->raid_ra_window = 0;
+        p->raid_ra_issued = block_num;
+    }
+    p->raid_ra_next = block_num + 1;
+    if (p->raid_ra_window == 0)
+        return;
+
+    uint64 from = block_num + 1;
+    if (p->raid_ra_issued >= from)
+        from = p->raid_ra_issued + 1;
+    uint64 to = block_num + p->raid_ra_window;
+    if (to > currMetadata->max_blknum)
+        to = currMetadata->max_blknum;
+
+    if (to < from)
+        return;
+    acquire(&cache.lock);
+    for (uint64 b = from; b <= to && cache.pending_tail - cache.pending_head < RAID_RA_PENDING; b++)
+        cache.pending[cache.pending_tail++ % RAID_RA_PENDING] = b;
+    release(&cache.lock);
+    queue_work(&cache.work);
+    p->raid_ra_issued = to;
+}
+
+// Drop a cached copy of a block that has just been written
+void raid_readahead_invalidate(uint64 block_num)
+{
+    acquire(&cache.lock);
+    for (int i = 0; i < RAID_RA_CACHE; i++)
+    {
+        struct RAIDCacheBlock *entry = &cache.blocks[i];
+        if (entry->block_num == block_num)
+            entry->stale = 1;
+    }
+    release(&cache.lock);
+}
+
+// Drop everything, the array was created or destroyed
+void raid_readahead_invalidate_all()
+{
+    acquire(&cache.lock);
+    for (int i = 0; i < RAID_RA_CACHE; i++)
+        cache.blocks[i].stale = 1;
+    release(&cache.lock);
+}
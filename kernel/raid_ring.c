@@ -0,0 +1,222 @@
+// Submission and completion rings for RAID I/O.
+//
+// init_ring_raid maps one page (struct RAIDRing) into the process at
+// RAIDRING. The process fills submission entries and advances sq_tail,
+// then calls enter_ring_raid(to_submit, min_complete). The kernel takes
+// up to to_submit entries, queues each on the member disks with
+// raid_async_rw() and returns without waiting for them, so one process
+// can keep up to RAID_RING_ENTRIES I/Os in flight. Finished requests are
+// posted to the completion queue, in the order the disks finish them;
+// enter_ring_raid waits until at least min_complete were posted.
+//
+// I/Os that raid_async_rw() can't queue (RAID4/5 and mirrored writes,
+// degraded arrays, reshape) are done synchronously on submission and
+// completed right away.
+
+#include "raid.h"
+#include "defs.h"
+#include "fs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "proc.h"
+#include "buf.h"
+
+// One submission, from the kernel taking it until its completion is posted
+struct RAIDRingRequest
+{
+    uint64 user_data;
+    uint64 addr;
+    int op;
+    int res;
+    int nbufs;       // bufs queued on member disks, 0 if done synchronously
+    struct buf b[1]; // queued on a member disk
+};
+
+static int finished(struct RAIDRingRequest *req)
+{
+    for (int i = 0; i < req->nbufs; i++)
+    {
+        if (req->b[i].disk)
+            return 0;
+    }
+    return 1;
+}
+
+static void wait_request(struct RAIDRingRequest *req)
+{
+    for (int i = 0; i < req->nbufs; i++)
+        virtio_disk_wait(req->b[i].dev, &req->b[i]);
+}
+
+static int cq_full(struct RAIDRing *ring)
+{
+    return ring->cq_tail - ring->cq_head >= RAID_RING_ENTRIES;
+}
+
+// Copy out read data and post the completion; caller checked cq_full
+static void post(struct proc *p, struct RAIDRing *ring, struct RAIDRingRequest *req)
+{
+    if (req->op == RAID_RING_READ && req->res == 0 &&
+        copyout(p->pagetable, req->addr, (char *)req->b[0].data, BSIZE) < 0)
+        req->res = -1;
+
+    struct RAIDRingCQE *cqe = &ring->cq[ring->cq_tail % RAID_RING_ENTRIES];
+    cqe->user_data = req->user_data;
+    cqe->res = req->res;
+    __sync_synchronize(); // Entry before the index that publishes it
+    ring->cq_tail++;
+}
+
+// Post finished requests until at least min were posted by this call,
+// or nothing is left to wait for. Returns the number posted.
+static int reap(struct proc *p, struct RAIDRingState *state, int min)
+{
+    struct RAIDRing *ring = state->ring;
+    int posted = 0;
+    for (;;)
+    {
+        for (int i = 0; i < state->count && !cq_full(ring);)
+        {
+            struct RAIDRingRequest *req = state->reqs[i];
+            if (!finished(req))
+            {
+                i++;
+                continue;
+            }
+            post(p, ring, req);
+            kfree(req);
+            state->reqs[i] = state->reqs[--state->count];
+            posted++;
+        }
+        if (posted >= min || state->count == 0 || cq_full(ring))
+            return posted;
+        wait_request(state->reqs[0]);
+    }
+}
+
+// Take one submission. Returns -1, leaving it on the ring, if there is
+// no memory for it
+static int start(struct proc *p, struct RAIDSuperblock *currMetadata, struct RAIDRingState *state, struct RAIDRingSQE *sqe)
+{
+    struct RAIDRingRequest *req = kalloc();
+    if (req == 0)
+        return -1;
+    memset(req, 0, sizeof(struct RAIDRingRequest));
+    req->user_data = sqe->user_data;
+    req->addr = sqe->addr;
+    req->op = sqe->op;
+    state->reqs[state->count++] = req;
+
+    int write = sqe->op == RAID_RING_WRITE;
+    if ((sqe->op != RAID_RING_READ && !write) || sqe->blkn > currMetadata->max_blknum)
+    {
+        req->res = -1;
+        return 0;
+    }
+    if (write && copyin(p->pagetable, (char *)req->b[0].data, sqe->addr, BSIZE) < 0)
+    {
+        req->res = -1;
+        return 0;
+    }
+
+    req->nbufs = raid_async_rw(currMetadata, sqe->blkn, req->b, write);
+    if (req->nbufs > 0)
+        return 0;
+
+    int locked = raid_io_begin();
+    if (write)
+    {
+        req->res = rw_block(currMetadata, sqe->blkn, (uint64)req->b[0].data, 0);
+        raid_readahead_invalidate(sqe->blkn);
+    }
+    else if (raid_readahead_read(sqe->blkn, req->b[0].data) != 0)
+    {
+        req->res = rw_block(currMetadata, sqe->blkn, (uint64)req->b[0].data, 1);
+    }
+    raid_io_end(locked);
+    return 0;
+}
+
+// Map the ring page into the calling process and store its address at ring_addr
+int raid_ring_setup(uint64 ring_addr)
+{
+    struct proc *p = myproc();
+    if (p->raid_ring != 0)
+        return -1; // One ring per process
+
+    struct RAIDRingState *state = kalloc();
+    struct RAIDRing *ring = kalloc();
+    if (state == 0 || ring == 0)
+        goto bad;
+    memset(state, 0, PGSIZE);
+    memset(ring, 0, PGSIZE);
+    state->ring = ring;
+    if (mappages(p->pagetable, RAIDRING, PGSIZE, (uint64)ring, PTE_R | PTE_W | PTE_U) != 0)
+        goto bad;
+
+    uint64 va = RAIDRING;
+    if (copyout(p->pagetable, ring_addr, (char *)&va, sizeof(va)) < 0)
+    {
+        uvmunmap(p->pagetable, RAIDRING, 1, 0);
+        goto bad;
+    }
+    p->raid_ring = state;
+    return 0;
+
+bad:
+    if (state)
+        kfree(state);
+    if (ring)
+        kfree(ring);
+    return -1;
+}
+
+// Take up to to_submit submissions, then wait for min_complete completions.
+// Returns the number of submissions taken.
+int raid_ring_enter(int to_submit, int min_complete)
+{
+    struct proc *p = myproc();
+    struct RAIDRingState *state = p->raid_ring;
+    if (state == 0)
+        return -1;
+    struct RAIDSuperblock *currMetadata;
+    if (load_metadata(&currMetadata) == -1)
+        return -2; // RAID is not initialized
+
+    struct RAIDRing *ring = state->ring;
+    int submitted = 0;
+    while (submitted < to_submit)
+    {
+        // Every request taken needs a completion slot in the end
+        if (state->count == RAID_RING_ENTRIES && reap(p, state, 1) == 0)
+            break;
+
+        uint head = ring->sq_head;
+        __sync_synchronize();
+        if (head == ring->sq_tail)
+            break;
+        struct RAIDRingSQE sqe = ring->sq[head % RAID_RING_ENTRIES]; // The process may change it later
+        if (start(p, currMetadata, state, &sqe) == -1)
+            break; // Out of memory, the process can submit it again later
+        __sync_synchronize();
+        ring->sq_head = head + 1;
+        submitted++;
+    }
+    reap(p, state, min_complete);
+    return submitted;
+}
+
+// Wait for the process's ring I/O and free the ring. The caller unmaps
+// the page, see proc_freepagetable().
+void raid_ring_release(struct proc *p)
+{
+    struct RAIDRingState *state = p->raid_ring;
+    for (int i = 0; i < state->count; i++)
+    {
+        wait_request(state->reqs[i]);
+        kfree(state->reqs[i]);
+    }
+    kfree(state->ring);
+    kfree(state);
+    p->raid_ring = 0;
+}
@@ -259,7 +259,8 @@ r_mcounteren()
   return x;
 }
 
-// machine-mode cycle counter
+// machine-mode cycle counter, readable in supervisor
+// mode once start() has set mcounteren.TM
 static inline uint64
 r_time()
 {
@@ -9,3 +9,13 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// Buffer cache counters, see bcachestat().
+struct bcachestat {
+  uint64 hits;      // block found in the cache
+  uint64 misses;    // block read from disk
+  uint64 evictions; // cached block dropped for another
+  uint64 ghosthits; // miss on a block evicted from probation lately
+  int nbuf;         // buffers in the cache
+  int nhot;         // buffers in the hot queue
+};
@@ -104,6 +104,11 @@ extern uint64 sys_disk_fail_raid(void);
 extern uint64 sys_disk_repaired_raid(void);
 extern uint64 sys_info_raid(void);
 extern uint64 sys_destroy_raid(void);
+extern uint64 sys_expand_raid(void);
+extern uint64 sys_init_ring_raid(void);
+extern uint64 sys_enter_ring_raid(void);
+extern uint64 sys_trim_raid(void);
+extern uint64 sys_bcachestat(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -136,6 +141,11 @@ static uint64 (*syscalls[])(void) = {
     [SYS_disk_repaired_raid] sys_disk_repaired_raid,
     [SYS_info_raid] sys_info_raid,
     [SYS_destroy_raid] sys_destroy_raid,
+    [SYS_expand_raid] sys_expand_raid,
+    [SYS_init_ring_raid] sys_init_ring_raid,
+    [SYS_enter_ring_raid] sys_enter_ring_raid,
+    [SYS_trim_raid] sys_trim_raid,
+    [SYS_bcachestat] sys_bcachestat,
 };
 
 void syscall(void)
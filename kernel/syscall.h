@@ -27,3 +27,8 @@
 #define SYS_disk_repaired_raid 26
 #define SYS_info_raid 27
 #define SYS_destroy_raid 28
+#define SYS_expand_raid 29
+#define SYS_init_ring_raid 30
+#define SYS_enter_ring_raid 31
+#define SYS_trim_raid 32
+#define SYS_bcachestat 33
@@ -503,3 +503,17 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Copy the buffer cache counters to the user's struct bcachestat.
+uint64
+sys_bcachestat(void)
+{
+  uint64 addr; // user pointer to struct bcachestat
+  struct bcachestat st;
+
+  argaddr(0, &addr);
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -59,3 +59,38 @@ uint64 sys_destroy_raid(void)
     printf("DESTROY RAID\n");
     return raid_system_destroy();
 }
+
+uint64 sys_expand_raid(void)
+{
+    int disk_num;
+    argint(0, &disk_num);
+    printf("EXPAND RAID\n");
+    return raid_expand_disk(disk_num);
+}
+
+uint64 sys_init_ring_raid(void)
+{
+    uint64 p_ring;
+    argaddr(0, &p_ring);
+    printf("INIT RING RAID\n");
+    return raid_ring_setup(p_ring);
+}
+
+uint64 sys_enter_ring_raid(void)
+{
+    int to_submit;
+    int min_complete;
+    argint(0, &to_submit);
+    argint(1, &min_complete);
+    return raid_ring_enter(to_submit, min_complete);
+}
+
+uint64 sys_trim_raid(void)
+{
+    int start;
+    int count;
+    argint(0, &start);
+    argint(1, &count);
+    printf("TRIM RAID\n");
+    return raid_trim(start, count);
+}
@@ -167,6 +167,7 @@ clockintr()
   ticks++;
   wakeup(&ticks);
   release(&tickslock);
+  raid_latency_tick();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -190,7 +191,7 @@ devintr()
       uartintr();
     } else if(irq == VIRTIO0_IRQ){
       virtio_disk_intr(VIRTIO0_ID);
-    } else if (irq >= VIRTIOX_IRQ(VIRTIO_RAID_DISK_START) && irq <= VIRTIOX_IRQ(VIRTIO_RAID_DISK_END)) {
+    } else if (irq >= VIRTIOX_IRQ(VIRTIO_RAID_DISK_START) && irq <= VIRTIOX_IRQ(VIRTIO_DISK_END)) {
       virtio_disk_intr(VIRTIOX_ID(irq));
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
@@ -31,6 +31,13 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH 0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW 0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG 0x100           // device-specific configuration space
+
+// virtio_blk_config, offsets from VIRTIO_MMIO_CONFIG
+#define VIRTIO_BLK_CONFIG_WRITEBACK 32     // byte, 1 for a write-back cache
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 32    // 32-bit word, num_queues is its upper half
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD 36   // max_discard_sectors
+#define VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES 48 // max_write_zeroes_sectors
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
@@ -41,8 +48,11 @@
 // device feature bits
 #define VIRTIO_BLK_F_RO 5          /* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI 7        /* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH 9       /* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE 11 /* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ 12         /* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD 13    /* Supports DISCARD requests */
+#define VIRTIO_BLK_F_WRITE_ZEROES 14 /* Supports WRITE_ZEROES requests */
 #define VIRTIO_F_ANY_LAYOUT 27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX 29
@@ -87,12 +97,23 @@ struct virtq_used {
 
 #define VIRTIO_BLK_T_IN 0  // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4         // make completed writes durable
+#define VIRTIO_BLK_T_DISCARD 11      // deallocate a range of sectors
+#define VIRTIO_BLK_T_WRITE_ZEROES 13 // zero a range of sectors
 
 // the format of the first descriptor in a disk request.
 // to be followed by two more descriptors containing
-// the block, and a one-byte status.
+// the block, and a one-byte status. a flush has no block.
 struct virtio_blk_req {
     uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
     uint32 reserved;
     uint64 sector;
 };
+
+// the data of a DISCARD or WRITE_ZEROES request, one per range.
+struct virtio_blk_discard_write_zeroes {
+    uint64 sector;
+    uint32 num_sectors;
+    uint32 flags;
+};
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1 // device may deallocate the zeroed range
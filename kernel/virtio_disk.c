@@ -18,11 +18,11 @@
 // the address of virtio mmio register r.
 #define R(offset, r) ((volatile uint32 *)(VIRTIO0 + VIRTIO_OFFSET * offset + (r)))
 
-static struct disk
+// one virtqueue. with VIRTIO_BLK_F_MQ a disk has one per hart,
+// each with its own lock, so harts submitting to the same disk
+// don't serialize on one another.
+struct vqueue
 {
-  // Name of the disk to be used with panic and spinlock
-  char *name;
-
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -50,7 +50,8 @@ static struct disk
   // indexed by first descriptor index of chain.
   struct
   {
-    struct buf *b;
+    struct buf *b[NSEG]; // one per data segment
+    int n;
     char status;
   } info[NUM];
 
@@ -58,17 +59,81 @@ static struct disk
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
 
-  struct spinlock vdisk_lock;
+  struct spinlock vq_lock;
+};
+
+static struct disk
+{
+  // Name of the disk to be used with panic and spinlock
+  char *name;
+
+  int nqueues; // queues in use, 1 unless the device offers VIRTIO_BLK_F_MQ
+
+  int writeback; // device may cache writes until a flush
+
+  // largest DISCARD and WRITE_ZEROES, in sectors. 0 if not supported.
+  uint32 max_discard;
+  uint32 max_write_zeroes;
+  struct vqueue q[NCPU];
+} disk[VIRTIO_DISK_END + 1];
+
+static struct buf *transfer_buffer[VIRTIO_DISK_END + 1];
+
+// set up virtqueue qi of disk id.
+static void
+vqueue_init(int id, int qi)
+{
+  struct vqueue *q = &disk[id].q[qi];
+  char *name = disk[id].name;
 
-} disk[VIRTIO_RAID_DISK_END + 1];
+  initlock(&q->vq_lock, name);
 
-static struct buf *transfer_buffer[VIRTIO_RAID_DISK_END + 1];
+  *R(id, VIRTIO_MMIO_QUEUE_SEL) = qi;
+
+  // ensure the queue is not in use.
+  if (*R(id, VIRTIO_MMIO_QUEUE_READY))
+    panic_concat(2, name, ": virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(id, VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if (max == 0)
+    panic_concat(2, name, ": virtio disk has no queue");
+  if (max < NUM)
+    panic_concat(2, name, ": virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if (!q->desc || !q->avail || !q->used)
+    panic_concat(2, name, ": virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(id, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(id, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(id, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(id, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(id, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(id, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(id, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(id, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for (int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
 
 void virtio_disk_init(int id, char *name)
 {
   uint32 status = 0;
 
-  initlock(&disk[id].vdisk_lock, name);
   disk[id].name = name;
 
   if (*R(id, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
@@ -94,8 +159,6 @@ void virtio_disk_init(int id, char *name)
   uint64 features = *R(id, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
-  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
@@ -110,47 +173,26 @@ void virtio_disk_init(int id, char *name)
   if (!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic_concat(2, name, ": virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(id, VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if (*R(id, VIRTIO_MMIO_QUEUE_READY))
-    panic_concat(2, name, ": virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(id, VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if (max == 0)
-    panic_concat(2, name, ": virtio disk has no queue 0");
-  if (max < NUM)
-    panic_concat(2, name, ": virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk[id].desc = kalloc();
-  disk[id].avail = kalloc();
-  disk[id].used = kalloc();
-  if (!disk[id].desc || !disk[id].avail || !disk[id].used)
-    panic_concat(2, name, ": virtio disk kalloc");
-  memset(disk[id].desc, 0, PGSIZE);
-  memset(disk[id].avail, 0, PGSIZE);
-  memset(disk[id].used, 0, PGSIZE);
-
-  // set queue size.
-  *R(id, VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(id, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk[id].desc;
-  *R(id, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk[id].desc >> 32;
-  *R(id, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk[id].avail;
-  *R(id, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk[id].avail >> 32;
-  *R(id, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk[id].used;
-  *R(id, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk[id].used >> 32;
+  // one queue per hart, as many as the device offers.
+  disk[id].nqueues = 1;
+  if (features & (1 << VIRTIO_BLK_F_MQ))
+  {
+    int n = (*R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES) >> 16) & 0xffff;
+    disk[id].nqueues = n < 1 ? 1 : (n > NCPU ? NCPU : n);
+  }
+  for (int qi = 0; qi < disk[id].nqueues; qi++)
+    vqueue_init(id, qi);
 
-  // queue is ready.
-  *R(id, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  // with FLUSH the device may cache writes, and a flush is the only
+  // way to know they are on disk. without it stay write-through.
+  disk[id].writeback = (features & (1 << VIRTIO_BLK_F_FLUSH)) != 0;
+  if (features & (1 << VIRTIO_BLK_F_CONFIG_WCE))
+    *(volatile uint8 *)R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_WRITEBACK) = disk[id].writeback;
 
-  // all NUM descriptors start out unused.
-  for (int i = 0; i < NUM; i++)
-    disk[id].free[i] = 1;
+  if (features & (1 << VIRTIO_BLK_F_DISCARD))
+    disk[id].max_discard = *R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_MAX_DISCARD);
+  if (features & (1 << VIRTIO_BLK_F_WRITE_ZEROES))
+    disk[id].max_write_zeroes = *R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -172,13 +214,13 @@ void virtio_disk_init(int id, char *name)
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc(int id)
+alloc_desc(struct vqueue *q)
 {
   for (int i = 0; i < NUM; i++)
   {
-    if (disk[id].free[i])
+    if (q->free[i])
     {
-      disk[id].free[i] = 0;
+      q->free[i] = 0;
       return i;
     }
   }
@@ -187,30 +229,30 @@ alloc_desc(int id)
 
 // mark a descriptor as free.
 static void
-free_desc(int id, int i)
+free_desc(int id, struct vqueue *q, int i)
 {
   if (i >= NUM)
     panic_concat(2, disk[id].name, ": free_desc 1");
-  if (disk[id].free[i])
+  if (q->free[i])
     panic_concat(2, disk[id].name, ": free_desc 2");
-  disk[id].desc[i].addr = 0;
-  disk[id].desc[i].len = 0;
-  disk[id].desc[i].flags = 0;
-  disk[id].desc[i].next = 0;
-  disk[id].free[i] = 1;
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
 
-  wakeup(&disk[id].free[0]);
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int id, int i)
+free_chain(int id, struct vqueue *q, int i)
 {
   while (1)
   {
-    int flag = disk[id].desc[i].flags;
-    int nxt = disk[id].desc[i].next;
-    free_desc(id, i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(id, q, i);
     if (flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -218,99 +260,157 @@ free_chain(int id, int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a transfer uses one for the header, one per data segment and
+// one for the status.
 static int
-alloc3_desc(int id, int *idx)
+alloc_descs(int id, struct vqueue *q, int *idx, int n)
 {
-  for (int i = 0; i < 3; i++)
+  for (int i = 0; i < n; i++)
   {
-    idx[i] = alloc_desc(id);
+    idx[i] = alloc_desc(q);
     if (idx[i] < 0)
     {
       for (int j = 0; j < i; j++)
-        free_desc(id, idx[j]);
+        free_desc(id, q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void virtio_disk_rw(int id, struct buf *b, int write)
+// queue a request of the given type for the n bufs in bs, which
+// hold adjacent blocks from sector on. each buf gets a data
+// descriptor covering the first len bytes of its data; with len 0
+// there is no data descriptor and n must be 1.
+// the request goes on the submitting hart's queue.
+static void
+submitv(int id, struct buf **bs, int n, uint32 type, uint64 sector, uint len)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-  acquire(&disk[id].vdisk_lock);
+  if (n < 1 || n > NSEG || (len == 0 && n != 1))
+    panic_concat(2, disk[id].name, ": submitv");
+
+  push_off();
+  int qi = cpuid() % disk[id].nqueues;
+  pop_off();
+  struct vqueue *q = &disk[id].q[qi];
+  acquire(&q->vq_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, one for each data
+  // segment, and one for a 1-byte status result.
+  int ndesc = len == 0 ? 2 : n + 2;
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NSEG + 2];
   while (1)
   {
-    if (alloc3_desc(id, idx) == 0)
+    if (alloc_descs(id, q, idx, ndesc) == 0)
     {
       break;
     }
 
-    sleep(&disk[id].free[0], &disk[id].vdisk_lock);
+    sleep(&q->free[0], &q->vq_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk[id].ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
-  if (write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->type = type;
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk[id].desc[idx[0]].addr = (uint64)buf0;
-  disk[id].desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk[id].desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk[id].desc[idx[0]].next = idx[1];
-  disk[id].desc[idx[1]].addr = (uint64)b->data;
-  disk[id].desc[idx[1]].len = BSIZE;
-  if (write)
-    disk[id].desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk[id].desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk[id].desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk[id].desc[idx[1]].next = idx[2];
-
-  disk[id].info[idx[0]].status = 0xff; // device writes 0 on success
-  disk[id].desc[idx[2]].addr = (uint64)&disk[id].info[idx[0]].status;
-  disk[id].desc[idx[2]].len = 1;
-  disk[id].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk[id].desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk[id].info[idx[0]].b = b;
+  q->desc[idx[0]].addr = (uint64)buf0;
+  q->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  q->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  q->desc[idx[0]].next = idx[1];
+
+  // data segments, if any, between header and status.
+  for (int i = 1; i < ndesc - 1; i++)
+  {
+    q->desc[idx[i]].addr = (uint64)bs[i - 1]->data;
+    q->desc[idx[i]].len = len;
+    if (type != VIRTIO_BLK_T_IN)
+      q->desc[idx[i]].flags = 0; // device reads data
+    else
+      q->desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes data
+    q->desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    q->desc[idx[i]].next = idx[i + 1];
+  }
+
+  int st = idx[ndesc - 1];
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  q->desc[st].addr = (uint64)&q->info[idx[0]].status;
+  q->desc[st].len = 1;
+  q->desc[st].flags = VRING_DESC_F_WRITE; // device writes the status
+  q->desc[st].next = 0;
+
+  // record the bufs for virtio_disk_intr().
+  for (int i = 0; i < n; i++)
+  {
+    bs[i]->disk = 1;
+    bs[i]->queue = qi;
+    q->info[idx[0]].b[i] = bs[i];
+  }
+  q->info[idx[0]].n = n;
 
   // tell the device the first index in our chain of descriptors.
-  disk[id].avail->ring[disk[id].avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk[id].avail->idx += 1; // not % NUM ...
+  q->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(id, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  *R(id, VIRTIO_MMIO_QUEUE_NOTIFY) = qi; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  sleep(b, &disk[id].vdisk_lock);
+  release(&q->vq_lock);
+}
 
-  disk[id].info[idx[0]].b = 0;
-  free_chain(id, idx[0]);
+// queue a request of the given type for b alone.
+static void
+submit(int id, struct buf *b, uint32 type, uint64 sector, uint len)
+{
+  submitv(id, &b, 1, type, sector, len);
+}
+
+// queue a request for b and return without waiting for it.
+// b->disk stays 1 until virtio_disk_intr() sees the completion;
+// use virtio_disk_wait() before touching b->data.
+void virtio_disk_submit(int id, struct buf *b, int write)
+{
+  submit(id, b, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, b->blockno * (BSIZE / 512), BSIZE);
+}
 
-  release(&disk[id].vdisk_lock);
+// like virtio_disk_submit(), for up to NSEG bufs of adjacent blocks
+// from bs[0]->blockno on, moved by one request.
+void virtio_disk_submit_range(int id, struct buf **bs, int n, int write)
+{
+  submitv(id, bs, n, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, bs[0]->blockno * (BSIZE / 512), BSIZE);
+}
+
+// wait for a request queued by virtio_disk_submit() to finish.
+void virtio_disk_wait(int id, struct buf *b)
+{
+  struct vqueue *q = &disk[id].q[b->queue];
+  acquire(&q->vq_lock);
+  while (b->disk == 1)
+  {
+    sleep(b, &q->vq_lock);
+  }
+  release(&q->vq_lock);
+}
+
+void virtio_disk_rw(int id, struct buf *b, int write)
+{
+  virtio_disk_submit(id, b, write);
+
+  // Wait for virtio_disk_intr() to say request has finished.
+  virtio_disk_wait(id, b);
 }
 
 void write_block(int diskn, int blockno, uchar *data)
@@ -335,10 +435,87 @@ void read_block(int diskn, int blockno, uchar *data)
   releasesleep(&b->lock);
 }
 
-void virtio_disk_intr(int id)
+// DISCARD or WRITE_ZEROES of nblocks blocks from blockno, in requests
+// of at most max sectors.
+static void
+range_rw(int id, uint32 type, uint32 max, uint64 blockno, uint64 nblocks, uint32 flags)
+{
+  struct buf *b = kalloc();
+  if (!b)
+    panic_concat(2, disk[id].name, ": range_rw kalloc");
+  memset(b, 0, sizeof(struct buf));
+  struct virtio_blk_discard_write_zeroes *range = (struct virtio_blk_discard_write_zeroes *)b->data;
+
+  max -= max % (BSIZE / 512); // whole blocks only
+  uint64 sector = blockno * (BSIZE / 512);
+  uint64 left = nblocks * (BSIZE / 512);
+  while (left > 0)
+  {
+    range->sector = sector;
+    range->num_sectors = left < max ? left : max;
+    range->flags = flags;
+    submit(id, b, type, 0, sizeof(struct virtio_blk_discard_write_zeroes));
+    virtio_disk_wait(id, b);
+    sector += range->num_sectors;
+    left -= range->num_sectors;
+  }
+  kfree(b);
+}
+
+// make every write the device has completed durable.
+// returns at once if the device doesn't cache writes.
+void virtio_disk_flush(int id)
+{
+  if (!disk[id].writeback)
+    return;
+
+  struct buf *b = kalloc();
+  if (!b)
+    panic_concat(2, disk[id].name, ": flush kalloc");
+  memset(b, 0, sizeof(struct buf));
+  submit(id, b, VIRTIO_BLK_T_FLUSH, 0, 0);
+  virtio_disk_wait(id, b);
+  kfree(b);
+}
+
+// zero nblocks blocks from blockno. with WRITE_ZEROES the device
+// zeroes the whole range at once and may deallocate it.
+void zero_blocks(int diskn, int blockno, int nblocks)
+{
+  if (disk[diskn].max_write_zeroes >= BSIZE / 512)
+  {
+    range_rw(diskn, VIRTIO_BLK_T_WRITE_ZEROES, disk[diskn].max_write_zeroes, blockno, nblocks,
+             VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+    return;
+  }
+
+  uchar *zero = kalloc();
+  memset(zero, 0, BSIZE);
+  for (int i = 0; i < nblocks; i++)
+    write_block(diskn, blockno + i, zero);
+  kfree(zero);
+}
+
+// tell the device nblocks blocks from blockno are no longer in use.
+// their contents are undefined afterwards.
+// returns -1 if the device doesn't support DISCARD.
+int discard_blocks(int diskn, int blockno, int nblocks)
 {
-  acquire(&disk[id].vdisk_lock);
+  if (disk[diskn].max_discard < BSIZE / 512)
+    return -1;
+  range_rw(diskn, VIRTIO_BLK_T_DISCARD, disk[diskn].max_discard, blockno, nblocks, 0);
+  return 0;
+}
 
+// completions aren't steered back to the submitting hart: a
+// virtio-mmio device has a single interrupt line for all of its
+// queues, and the PLIC can only route that line as a whole, so
+// whichever hart claims it handles every queue. per-queue vectors
+// would need virtio-pci with MSI-X. queues without new completions
+// are skipped without taking their lock, so the handler only
+// contends with the harts whose requests finished.
+void virtio_disk_intr(int id)
+{
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -349,24 +526,44 @@ void virtio_disk_intr(int id)
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while (disk[id].used_idx != disk[id].used->idx)
+  for (int qi = 0; qi < disk[id].nqueues; qi++)
   {
-    __sync_synchronize();
-    int idx = disk[id].used->ring[disk[id].used_idx % NUM].id;
+    struct vqueue *q = &disk[id].q[qi];
+    // only this handler moves used_idx, and the PLIC hands an
+    // interrupt to one hart at a time.
+    if (q->used_idx == q->used->idx)
+      continue;
+    acquire(&q->vq_lock);
 
-    if (disk[id].info[idx].status != 0)
-      panic_concat(2, disk[id].name, ": virtio_disk_intr status");
+    // the device increments used->idx when it
+    // adds an entry to the used ring.
 
-    struct buf *b = disk[id].info[idx].b;
-    b->disk = 0; // disk is done with buf
+    while (q->used_idx != q->used->idx)
+    {
+      __sync_synchronize();
+      int idx = q->used->ring[q->used_idx % NUM].id;
 
-    wakeup(b);
+      if (q->info[idx].status != 0)
+        panic_concat(2, disk[id].name, ": virtio_disk_intr status");
 
-    disk[id].used_idx += 1;
-  }
+      // the submitter may not be waiting, so the chain is freed here.
+      free_chain(id, q, idx);
+
+      for (int i = 0; i < q->info[idx].n; i++)
+      {
+        struct buf *b = q->info[idx].b[i];
+        void (*done)(struct buf *) = b->done;
+        b->disk = 0; // disk is done with buf
+        q->info[idx].b[i] = 0;
+
+        wakeup(b);
+        if (done)
+          done(b); // last, b may be freed once b->disk is 0
+      }
 
-  release(&disk[id].vdisk_lock);
+      q->used_idx += 1;
+    }
+
+    release(&q->vq_lock);
+  }
 }
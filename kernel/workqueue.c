@@ -0,0 +1,161 @@
+// Work queues: deferred kernel work run by kernel threads.
+//
+// Every CPU has a queue and a worker thread that only runs on that
+// CPU. queue_work() puts work on the queue of the CPU it is called on,
+// so short jobs run close to where they were raised and CPUs don't
+// contend for one queue. Jobs that run for long, like a rebuild or a
+// reshape, go through queue_work_long() to a queue of their own, so
+// they don't hold up the short jobs of a CPU.
+//
+// A work is queued at most once at a time and never runs on two
+// workers at once. Queuing it again while it runs doesn't put it on a
+// queue; the worker running it queues it behind the others once fn
+// returns, so it runs once more afterwards.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "workqueue.h"
+
+#define NWORKERS (CPUS < NCPU ? CPUS : NCPU)
+#define LONGQ NCPU // index of the queue for long jobs
+
+struct workqueue {
+  struct spinlock lock;
+  struct work *head;
+  struct work *tail;
+};
+
+static struct workqueue wq[NCPU + 1];
+
+// protects queued, running and pending of every work.
+static struct spinlock work_lock;
+
+static void
+worker(void *arg)
+{
+  struct workqueue *q = arg;
+
+  acquire(&q->lock);
+  for(;;){
+    while(q->head == 0)
+      sleep(q, &q->lock);
+    struct work *w = q->head;
+    q->head = w->next;
+    if(q->head == 0)
+      q->tail = 0;
+    release(&q->lock);
+
+    acquire(&work_lock);
+    w->queued = 0;
+    w->running = 1;
+    release(&work_lock);
+
+    w->fn(w);
+
+    acquire(&work_lock);
+    w->running = 0;
+    int again = w->pending;
+    w->pending = 0;
+    wakeup(w);
+    release(&work_lock);
+
+    acquire(&q->lock);
+    if(again){
+      // still marked queued, so nobody else puts it on a queue.
+      w->next = 0;
+      if(q->tail)
+        q->tail->next = w;
+      else
+        q->head = w;
+      q->tail = w;
+    }
+  }
+}
+
+// start the workers. called once, after userinit so init keeps pid 1.
+void
+workqueue_init(void)
+{
+  initlock(&work_lock, "work");
+  for(int i = 0; i <= NCPU; i++)
+    initlock(&wq[i].lock, "workqueue");
+
+  char name[16];
+  for(int i = 0; i < NWORKERS; i++){
+    safestrcpy(name, "kworker/", sizeof(name));
+    itoa(i, 10, name);
+    kthread_create(name, worker, &wq[i], i);
+  }
+  kthread_create("kworker/long", worker, &wq[LONGQ], -1);
+}
+
+void
+init_work(struct work *w, void (*fn)(struct work *))
+{
+  w->fn = fn;
+  w->next = 0;
+  w->queued = 0;
+  w->running = 0;
+  w->pending = 0;
+}
+
+static int
+enqueue(struct workqueue *q, struct work *w)
+{
+  acquire(&work_lock);
+  if(w->queued){
+    release(&work_lock);
+    return 0;
+  }
+  w->queued = 1;
+  if(w->running){
+    // its worker queues it again when fn returns.
+    w->pending = 1;
+    release(&work_lock);
+    return 1;
+  }
+  release(&work_lock);
+
+  acquire(&q->lock);
+  w->next = 0;
+  if(q->tail)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+  wakeup(q);
+  release(&q->lock);
+  return 1;
+}
+
+// run w soon on this CPU's worker.
+// returns 0 if w was already queued.
+int
+queue_work(struct work *w)
+{
+  push_off();
+  int id = cpuid();
+  pop_off();
+  return enqueue(&wq[id < NWORKERS ? id : LONGQ], w);
+}
+
+// run w on the worker for long jobs.
+int
+queue_work_long(struct work *w)
+{
+  return enqueue(&wq[LONGQ], w);
+}
+
+// wait until w is neither queued nor running.
+void
+flush_work(struct work *w)
+{
+  acquire(&work_lock);
+  while(w->queued || w->running)
+    sleep(w, &work_lock);
+  release(&work_lock);
+}
@@ -0,0 +1,9 @@
+// Deferred kernel work, run by a worker thread. Embed it in the
+// structure the work is about, and set it up with init_work().
+struct work {
+  void (*fn)(struct work *); // runs in a worker thread
+  struct work *next;         // queue of the worker
+  int queued;                // on a queue, protected by work_lock
+  int running;               // fn is running, protected by work_lock
+  int pending;               // queued while running, protected by work_lock
+};
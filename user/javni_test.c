@@ -1,6 +1,9 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/fs.h"
 
 // Forward decl for existing helper used by init_test/my_test
 void check_data(uint blocks, uchar *blk, uint block_size);
@@ -271,6 +274,8 @@ static void ultimate_one(enum RAID_TYPE t)
     }
     case RAID1:
     case RAID0_1:
+    case RAID10_NEAR:
+    case RAID10_FAR:
     {
         if (phys >= 2)
         {
@@ -359,8 +364,9 @@ static void ultimate_one(enum RAID_TYPE t)
 
 void ultimate_test()
 {
-    enum RAID_TYPE raidList[] = {RAID0, RAID1, RAID0_1, RAID4, RAID5};
-    for (uint k = 4; k < 5; k++)
+    enum RAID_TYPE raidList[] = {RAID0, RAID1, RAID0_1, RAID4, RAID5, RAID10_NEAR, RAID10_FAR};
+    // RAID5 and the RAID10 levels
+    for (uint k = 4; k < sizeof(raidList) / sizeof(raidList[0]); k++)
     {
         printf("=== Ultimate RAID test type=%d ===\n", raidList[k]);
         ultimate_one(raidList[k]);
@@ -402,9 +408,9 @@ void init_test()
 
 void my_test()
 {
-    enum RAID_TYPE raidList[] = {RAID0, RAID1, RAID0_1, RAID4, RAID5};
+    enum RAID_TYPE raidList[] = {RAID0, RAID1, RAID0_1, RAID4, RAID5, RAID10_NEAR, RAID10_FAR};
 
-    for (uint k = 0; k < 5; k++)
+    for (uint k = 0; k < 7; k++)
     {
         init_raid(raidList[k]);
 
@@ -460,6 +466,290 @@ void textwrite(char *s)
     exit(0);
 }
 
+// Keep a whole ring of writes, then reads, in flight from one process
+void ring_test()
+{
+    init_raid(RAID0);
+    uint disk_num, block_num, block_size;
+    info_raid(&block_num, &block_size, &disk_num);
+
+    struct RAIDRing *ring;
+    if (init_ring_raid(&ring) < 0)
+    {
+        printf("init_ring_raid failed\n");
+        exit(1);
+    }
+    uint blocks = RAID_RING_ENTRIES;
+    uchar *bufs = malloc(blocks * block_size);
+    for (int op = RAID_RING_WRITE; op >= RAID_RING_READ; op--)
+    {
+        for (uint i = 0; i < blocks; i++)
+        {
+            if (op == RAID_RING_WRITE)
+                fill_pattern(bufs + i * block_size, block_size, i, 0x5a);
+            struct RAIDRingSQE *sqe = &ring->sq[ring->sq_tail % RAID_RING_ENTRIES];
+            sqe->addr = (uint64)(bufs + i * block_size);
+            sqe->blkn = i;
+            sqe->op = op;
+            sqe->user_data = i;
+            ring->sq_tail++;
+        }
+        if (enter_ring_raid(blocks, blocks) != blocks)
+        {
+            printf("enter_ring_raid did not take every submission\n");
+            exit(1);
+        }
+        while (ring->cq_head != ring->cq_tail)
+        {
+            struct RAIDRingCQE *cqe = &ring->cq[ring->cq_head % RAID_RING_ENTRIES];
+            if (cqe->res < 0)
+            {
+                printf("ring I/O failed blk=%d\n", (int)cqe->user_data);
+                exit(1);
+            }
+            ring->cq_head++;
+        }
+    }
+    for (uint i = 0; i < blocks; i++)
+    {
+        if (verify_pattern(bufs + i * block_size, block_size, i, 0x5a) != 0)
+        {
+            printf("ring verify failed blk=%d\n", i);
+            exit(1);
+        }
+    }
+    free(bufs);
+}
+
+// Trim a range that starts and ends inside a stripe, then check it
+// reads as zeroes, also when parity has to stand in for a disk
+void trim_test()
+{
+    enum RAID_TYPE raidList[] = {RAID1, RAID5};
+    for (uint k = 0; k < 2; k++)
+    {
+        init_raid(raidList[k]);
+        uint disk_num, block_num, block_size;
+        info_raid(&block_num, &block_size, &disk_num);
+
+        uint blocks = 64;
+        uint first = 5, count = 46;
+        uchar *blk = malloc(block_size);
+        for (uint i = 0; i < blocks; i++)
+        {
+            fill_pattern(blk, block_size, i, 0x3c);
+            write_raid(i, blk);
+        }
+        if (trim_raid(first, count) != 0)
+        {
+            printf("trim_raid failed\n");
+            exit(1);
+        }
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (uint i = 0; i < blocks; i++)
+            {
+                read_raid(i, blk);
+                int trimmed = i >= first && i < first + count;
+                int bad = 0;
+                for (uint j = 0; j < block_size && trimmed; j++)
+                    bad |= blk[j] != 0;
+                if (!trimmed)
+                    bad = verify_pattern(blk, block_size, i, 0x3c) != 0;
+                if (bad)
+                {
+                    printf("trim verify failed blk=%d pass=%d\n", i, pass);
+                    exit(1);
+                }
+            }
+            disk_fail_raid(1);
+        }
+        disk_repaired_raid(1);
+        free(blk);
+    }
+}
+
+static void write_file(char *name, uint blocks, uint tag, uchar *blk)
+{
+    int fd = open(name, O_CREATE | O_RDWR);
+    if (fd < 0)
+    {
+        printf("bcache_test: open %s failed\n", name);
+        exit(1);
+    }
+    for (uint i = 0; i < blocks; i++)
+    {
+        fill_pattern(blk, BSIZE, i, tag);
+        if (write(fd, blk, BSIZE) != BSIZE)
+        {
+            printf("bcache_test: write of %s block %d failed\n", name, i);
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+static void read_file(char *name, uint blocks, uint tag, uchar *blk)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("bcache_test: open %s failed\n", name);
+        exit(1);
+    }
+    for (uint i = 0; i < blocks; i++)
+    {
+        if (read(fd, blk, BSIZE) != BSIZE || verify_pattern(blk, BSIZE, i, tag) != 0)
+        {
+            printf("bcache verify failed %s blk=%d\n", name, i);
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+// Take all free memory but a few pages, so the buffer cache gives
+// back what it can and can't grow again. Returns the pages taken.
+static int hog_memory(void)
+{
+    int n = 0;
+    while (sbrk(64 * 4096) != (char *)-1)
+        n += 64;
+    while (sbrk(4096) != (char *)-1)
+        n++;
+    sbrk(-32 * 4096);
+    return n - 32;
+}
+
+// Keep a small file and its directory hot while a file larger than
+// the cache streams through it twice. Once the hot blocks made it to
+// the hot queue, the second stream must not push them out.
+static void bcache_scan_test(uchar *blk)
+{
+    uint hot = 8, every = 32;
+    write_file("bcache_hot", hot, 0x5a, blk);
+
+    int pages = hog_memory();
+    struct bcachestat st, before, after;
+    bcachestat(&st);
+    uint stream = 2 * st.nbuf + every;
+    if (stream > FSSIZE / 2)
+    {
+        printf("bcache_scan_test: cache of %d buffers doesn't fit the disk twice\n", st.nbuf);
+        exit(1);
+    }
+    write_file("bcache_stream", stream, 0x66, blk);
+
+    read_file("bcache_hot", hot, 0x5a, blk);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64 misses = 0, ghosthits = 0;
+        int fd = open("bcache_stream", O_RDONLY);
+        for (uint i = 0; i < stream; i++)
+        {
+            if (read(fd, blk, BSIZE) != BSIZE || verify_pattern(blk, BSIZE, i, 0x66) != 0)
+            {
+                printf("bcache verify failed bcache_stream blk=%d pass=%d\n", i, pass);
+                exit(1);
+            }
+            if (i % every != every - 1)
+                continue;
+            bcachestat(&before);
+            read_file("bcache_hot", hot, 0x5a, blk);
+            bcachestat(&after);
+            misses += after.misses - before.misses;
+            ghosthits += after.ghosthits - before.ghosthits;
+        }
+        close(fd);
+        printf("scan pass %d: %d blocks streamed past %d buffers, hot set misses %d ghost hits %d\n",
+               pass, stream, st.nbuf, (int)misses, (int)ghosthits);
+        if (pass == 1 && (misses > hot / 4 || ghosthits > hot / 4))
+        {
+            printf("bcache_scan_test: the stream pushed out the hot set\n");
+            exit(1);
+        }
+    }
+
+    sbrk(-pages * 4096);
+    unlink("bcache_stream");
+    unlink("bcache_hot");
+}
+
+// Write a file, then read it twice. The second pass must be served
+// from the buffer cache.
+void bcache_test()
+{
+    uint blocks = 200;
+    uchar *blk = malloc(BSIZE);
+    write_file("bcache_test", blocks, 0x77, blk);
+
+    struct bcachestat before, after;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bcachestat(&before);
+        read_file("bcache_test", blocks, 0x77, blk);
+        bcachestat(&after);
+        printf("pass %d: hits %d misses %d evictions %d ghost hits %d, %d buffers, %d hot\n", pass,
+               (int)(after.hits - before.hits), (int)(after.misses - before.misses),
+               (int)(after.evictions - before.evictions), (int)(after.ghosthits - before.ghosthits),
+               after.nbuf, after.nhot);
+    }
+    if (after.misses - before.misses > blocks / 10)
+    {
+        printf("bcache second pass missed too often\n");
+        exit(1);
+    }
+    unlink("bcache_test");
+
+    bcache_scan_test(blk);
+    free(blk);
+    printf("bcache_test: ok\n");
+}
+
+// A file longer than an inode without extents can map
+void extent_test()
+{
+    uint blocks = MAXFILE * 2 + 10;
+    uchar *blk = malloc(BSIZE);
+    int fd = open("extent_test", O_CREATE | O_RDWR);
+    if (fd < 0)
+    {
+        printf("extent_test: open failed\n");
+        exit(1);
+    }
+    for (uint i = 0; i < blocks; i++)
+    {
+        fill_pattern(blk, BSIZE, i, 0x31);
+        if (write(fd, blk, BSIZE) != BSIZE)
+        {
+            printf("extent_test: write of block %d failed\n", i);
+            exit(1);
+        }
+    }
+    close(fd);
+
+    struct stat st;
+    fd = open("extent_test", O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.size != (uint64)blocks * BSIZE)
+    {
+        printf("extent_test: wrong size\n");
+        exit(1);
+    }
+    for (uint i = 0; i < blocks; i++)
+    {
+        if (read(fd, blk, BSIZE) != BSIZE || verify_pattern(blk, BSIZE, i, 0x31) != 0)
+        {
+            printf("extent_test: verify failed blk=%d\n", i);
+            exit(1);
+        }
+    }
+    close(fd);
+    unlink("extent_test");
+    free(blk);
+    printf("extent_test: %d blocks ok\n", blocks);
+}
+
 int main(int argc, char *argv[])
 {
     if (argc == 2 && strcmp(argv[1], "--rw-test") == 0)
@@ -468,6 +758,14 @@ int main(int argc, char *argv[])
         init_test();
     if (argc == 2 && strcmp(argv[1], "--ultimate-test") == 0)
         ultimate_test();
+    if (argc == 2 && strcmp(argv[1], "--ring-test") == 0)
+        ring_test();
+    if (argc == 2 && strcmp(argv[1], "--trim-test") == 0)
+        trim_test();
+    if (argc == 2 && strcmp(argv[1], "--bcache-test") == 0)
+        bcache_test();
+    if (argc == 2 && strcmp(argv[1], "--extent-test") == 0)
+        extent_test();
     if (argc == 2 && strcmp(argv[1], "--text-write") == 0)
         textwrite("Test");
     exit(0);
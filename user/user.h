@@ -1,4 +1,5 @@
 struct stat;
+struct bcachestat;
 
 // system calls
 int fork(void);
@@ -22,6 +23,7 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int bcachestat(struct bcachestat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -45,7 +47,9 @@ enum RAID_TYPE { RAID0,
                  RAID1,
                  RAID0_1,
                  RAID4,
-                 RAID5 };
+                 RAID5,
+                 RAID10_NEAR,
+                 RAID10_FAR };
 int init_raid(enum RAID_TYPE raid);
 int read_raid(int blkn, uchar* data);
 int write_raid(int blkn, uchar* data);
@@ -53,3 +57,31 @@ int disk_fail_raid(int diskn);
 int disk_repaired_raid(int diskn);
 int info_raid(uint* blkn, uint* blks, uint* diskn);
 int destroy_raid();
+int expand_raid(int diskn);
+int trim_raid(int start, int count);
+
+// RAID I/O rings, see kernel/raid_ring.c
+#define RAID_RING_ENTRIES 64
+#define RAID_RING_READ 0
+#define RAID_RING_WRITE 1
+struct RAIDRingSQE {
+    uint64 addr;
+    uint blkn;
+    uint op;
+    uint64 user_data;
+};
+struct RAIDRingCQE {
+    uint64 user_data;
+    int res;
+    uint reserved;
+};
+struct RAIDRing {
+    uint sq_head;
+    uint sq_tail;
+    uint cq_head;
+    uint cq_tail;
+    struct RAIDRingSQE sq[RAID_RING_ENTRIES];
+    struct RAIDRingCQE cq[RAID_RING_ENTRIES];
+};
+int init_ring_raid(struct RAIDRing** ring);
+int enter_ring_raid(int to_submit, int min_complete);
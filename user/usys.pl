@@ -42,4 +42,9 @@ entry("write_raid");
 entry("disk_fail_raid");
 entry("disk_repaired_raid");
 entry("info_raid");
-entry("destroy_raid");
\ No newline at end of file
+entry("destroy_raid");
+entry("expand_raid");
+entry("init_ring_raid");
+entry("enter_ring_raid");
+entry("trim_raid");
+entry("bcachestat");